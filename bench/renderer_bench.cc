@@ -0,0 +1,481 @@
+// Times the hot kernels of the renderer in isolation and prints the results as
+// JSON, in a fixed order. Every benchmark does a fixed amount of work on inputs
+// from a fixed seed and reports the fastest of a few runs, so that the output
+// of two commits can be diffed.
+//
+// Usage: renderer_bench [substring of the names of the benchmarks to run]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "app/mesh_file.h"
+#include "app/obj_parser.h"
+#include "app/tga_loader.h"
+#include "renderer/arena.h"
+#include "renderer/pipeline.h"
+#include "renderer/raster.h"
+
+using namespace renderer;
+
+namespace renderer {
+
+// Calls the private stages of a pipeline whose program and framebuffer are set.
+struct PipelineBench {
+  static auto screen(const Pipeline &p, Pipeline::ThreadStats &stats) {
+    return Pipeline::Tile{.x0 = 0,
+                          .y0 = 0,
+                          .x1 = static_cast<int>(p.fb_->getWidth()) - 1,
+                          .y1 = static_cast<int>(p.fb_->getHeight()) - 1,
+                          .stats = &stats};
+  }
+  // Through the variant a draw with the pipeline's state would use.
+  static bool setup(Pipeline &p, Triangle &tri) { return (p.*p.getVariant().setup_triangle)(tri); }
+  static void fill(Pipeline &p, const VertexH &v1, const VertexH &v2, float x, float y, float w,
+                   const Pipeline::Tile &tile) {
+    p.fill<Pipeline::DynamicShading>(v1, v2, x, y, w, tile);
+  }
+  static void fill(Pipeline &p, const Triangle &tri, float x, float y, float w0, float w1,
+                   float w2, const Pipeline::Tile &tile) {
+    (p.*p.getVariant().fill)(tri, x, y, w0, w1, w2, tile);
+  }
+  static void rasterize(Pipeline &p, const Triangle &tri, const Pipeline::Tile &tile) {
+    (p.*p.getVariant().rasterize_triangle)(tri, tile);
+  }
+};
+
+} // namespace renderer
+
+namespace {
+
+using detail::attrBlockSize;
+
+struct Result {
+  double ns_per_op;
+  double pixels_per_s{}; // Left out of the output when zero.
+  double triangles_per_s{};
+  size_t differing_pixels{}; // From a reference image; left out when zero.
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<Result()> run;
+};
+
+constexpr auto runs = 5;
+constexpr auto seed = 42u;
+constexpr unsigned fb_size{1024};
+
+// Keeps the compiler from dropping the computation of v.
+template <class T> void keep(const T &v) {
+#ifdef __GNUC__
+  asm volatile("" : : "r,m"(v) : "memory");
+#else
+  static const void *volatile sink;
+  sink = &v;
+#endif
+}
+
+// Nanoseconds taken by the fastest of a few calls of fn.
+template <class F> double fastest(F fn) {
+  auto best = std::numeric_limits<double>::max();
+  for (auto i = 0; i < runs; ++i) {
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count());
+  }
+  return best;
+}
+
+// Outputs an interpolated color, in packets unless packets is false.
+struct BenchProgram : Program {
+  constexpr static unsigned attrs{8};
+
+  static void vertexShader(const Vertex &, const void *, VertexH &) {}
+
+  static void fragmentShader(const Fragment &in, const void *, Vec4 &out) {
+    auto attr = static_cast<const float *>(in.attr);
+    out = {attr[0], attr[1], attr[2], 1.f};
+  }
+
+  static void packetFragmentShader(const FragmentPacket &in, const void *, Vec4x8 &out) {
+    out = {in.attr[0], in.attr[1], in.attr[2], Float8{1.f}};
+  }
+
+  explicit BenchProgram(bool packets = true)
+      : Program{.vs = vertexShader,
+                .fs = fragmentShader,
+                .attr_count = attrs,
+                .fs_packet = packets ? packetFragmentShader : nullptr} {}
+};
+
+// Screen-space triangles with random attributes, as the transform stage leaves
+// them.
+struct TriangleSet {
+  TriangleSet(size_t count, unsigned attr_count)
+      : verts(3 * count), vert_attrs(3 * count, attrBlockSize(attr_count), 32),
+        tri_attrs(count, 3 * attrBlockSize(attr_count), 32) {
+    std::mt19937 rng{seed};
+    std::uniform_real_distribution<float> dist{0.f, 1.f};
+    for (auto i = 0uz; i < verts.size(); ++i) {
+      verts[i].attr = vert_attrs.at<float>(i);
+      for (auto j = 0u; j < attr_count; ++j)
+        static_cast<float *>(verts[i].attr)[j] = dist(rng);
+    }
+    for (auto i = 0uz; i < count; ++i)
+      triangles.push_back({.v = {&verts[3 * i], &verts[3 * i + 1], &verts[3 * i + 2]},
+                           .attr = tri_attrs.at<float>(i)});
+  }
+
+  std::vector<VertexH> verts;
+  Arena vert_attrs;
+  Arena tri_attrs;
+  std::vector<Triangle> triangles;
+};
+
+Result benchSetupEdge() {
+  constexpr auto count = 1uz << 16;
+  std::mt19937 rng{seed};
+  std::uniform_int_distribution<int> coord{0, static_cast<int>(fb_size) << detail::prec_bits};
+  std::vector<int> coords(4 * count);
+  for (auto &c : coords)
+    c = coord(rng);
+
+  auto ns = fastest([&] {
+    for (auto i = 0uz; i < count; ++i) {
+      auto *c = &coords[4 * i];
+      keep(detail::setup_edge(c[0], c[1], c[2], c[3], c[0] & detail::prec_mask,
+                              c[1] & detail::prec_mask, detail::prec_bits));
+    }
+  });
+  return {.ns_per_op = ns / count};
+}
+
+Result benchPrecomputeAttrs(unsigned attr_count) {
+  constexpr auto count = 1uz << 14;
+  TriangleSet set{count, attr_count};
+  for (auto &vert : set.verts)
+    vert.pos = {0.f, 0.f, .5f, .5f};
+
+  auto ns = fastest([&] {
+    for (auto &tri : set.triangles)
+      detail::precomputeAttrs(tri, attr_count);
+    keep(*set.triangles.back().attr);
+  });
+  return {.ns_per_op = ns / count, .triangles_per_s = count / ns * 1e9};
+}
+
+// Both fill() overloads shade every pixel of a square once, with early Z
+// passing.
+Result benchFill(bool line) {
+  constexpr unsigned size{256};
+  BenchProgram prog;
+  FrameBuffer fb{size, size};
+  Pipeline p;
+  p.setProgram(&prog);
+  p.setFrameBuffer(&fb);
+  Pipeline::ThreadStats stats;
+  auto tile = PipelineBench::screen(p, stats);
+
+  TriangleSet set{1, BenchProgram::attrs};
+  auto &tri = set.triangles[0];
+  tri.v[0]->pos = {0.f, 0.f, .2f, 1.f};
+  tri.v[1]->pos = {size - 1.f, 0.f, .5f, .5f};
+  tri.v[2]->pos = {0.f, size - 1.f, .8f, .25f};
+  PipelineBench::setup(p, tri);
+
+  auto ns = fastest([&] {
+    fb.clear();
+    for (auto y = 0u; y < size; ++y) {
+      for (auto x = 0u; x < size; ++x) {
+        auto w1 = static_cast<float>(x) / size;
+        auto w2 = static_cast<float>(y) / size * (1.f - w1);
+        if (line)
+          PipelineBench::fill(p, *tri.v[0], *tri.v[1], static_cast<float>(x),
+                              static_cast<float>(y), w1, tile);
+        else
+          PipelineBench::fill(p, tri, static_cast<float>(x), static_cast<float>(y),
+                              1.f - w1 - w2, w1, w2, tile);
+      }
+    }
+  });
+  constexpr auto pixels = size * size;
+  return {.ns_per_op = ns / pixels, .pixels_per_s = pixels / ns * 1e9};
+}
+
+// Triangles with vertices up to size pixels away from a random center, each
+// nearer than the ones before it, so that none is occluded. Fragments are
+// shaded one at a time or in packets, to compare the two.
+Result benchRasterize(float size, bool packets) {
+  auto count = std::clamp(static_cast<size_t>((1 << 22) / (size * size)), 64uz, 1uz << 16);
+  BenchProgram prog{packets};
+  FrameBuffer fb{fb_size, fb_size};
+  Pipeline p;
+  p.setProgram(&prog);
+  p.setFrameBuffer(&fb);
+  Pipeline::ThreadStats stats;
+  auto tile = PipelineBench::screen(p, stats);
+
+  TriangleSet set{count, BenchProgram::attrs};
+  std::mt19937 rng{seed};
+  std::uniform_real_distribution<float> center{size, fb_size - 1 - size};
+  std::uniform_real_distribution<float> offset{-size, size};
+  std::vector<Triangle> triangles;
+  for (auto i = 0uz; i < count; ++i) {
+    auto &tri = set.triangles[i];
+    auto cx = center(rng);
+    auto cy = center(rng);
+    auto z = 1.f - static_cast<float>(i + 1) / (count + 1);
+    for (auto *v : tri.v)
+      v->pos = {cx + offset(rng), cy + offset(rng), z, 1.f};
+    if (PipelineBench::setup(p, tri))
+      triangles.push_back(tri);
+  }
+
+  auto fragments = 0uz;
+  auto ns = fastest([&] {
+    fb.clear();
+    stats = {};
+    for (auto &tri : triangles)
+      PipelineBench::rasterize(p, tri, tile);
+    fragments = stats.fragments;
+  });
+  return {.ns_per_op = ns / triangles.size(),
+          .pixels_per_s = fragments / ns * 1e9,
+          .triangles_per_s = triangles.size() / ns * 1e9};
+}
+
+// Triangles as in benchRasterize(), each at a constant depth from a range so
+// narrow that less precise depth formats get some of their order wrong.
+// Compares the image with that of D32F.
+Result benchDepthFormat(FrameBuffer::DepthFormat format) {
+  constexpr auto count = 1uz << 12;
+  constexpr auto size = 32.f;
+  BenchProgram prog;
+  FrameBuffer reference{fb_size, fb_size};
+  FrameBuffer fb{fb_size, fb_size, format};
+  Pipeline p;
+  p.setProgram(&prog);
+  Pipeline::ThreadStats stats;
+
+  TriangleSet set{count, BenchProgram::attrs};
+  std::mt19937 rng{seed};
+  std::uniform_real_distribution<float> center{size, fb_size - 1 - size};
+  std::uniform_real_distribution<float> offset{-size, size};
+  std::uniform_real_distribution<float> depth{.99f, .9901f};
+  std::vector<Triangle> triangles;
+  for (auto &tri : set.triangles) {
+    auto cx = center(rng);
+    auto cy = center(rng);
+    auto z = depth(rng);
+    for (auto *v : tri.v)
+      v->pos = {cx + offset(rng), cy + offset(rng), z, 1.f};
+    if (PipelineBench::setup(p, tri))
+      triangles.push_back(tri);
+  }
+
+  auto draw = [&](FrameBuffer &target) {
+    p.setFrameBuffer(&target);
+    auto tile = PipelineBench::screen(p, stats);
+    target.clear();
+    stats = {};
+    for (auto &tri : triangles)
+      PipelineBench::rasterize(p, tri, tile);
+  };
+  draw(reference);
+  auto ns = fastest([&] { draw(fb); });
+
+  auto &expected = reference.getColorTexture();
+  auto &actual = fb.getColorTexture();
+  auto differing = 0uz;
+  for (auto y = 0u; y < fb_size; ++y)
+    for (auto x = 0u; x < fb_size; ++x)
+      differing += actual.getSpan(x, y)->rgba != expected.getSpan(x, y)->rgba;
+  return {.ns_per_op = ns / triangles.size(),
+          .pixels_per_s = stats.depth_tests / ns * 1e9,
+          .triangles_per_s = triangles.size() / ns * 1e9,
+          .differing_pixels = differing};
+}
+
+std::vector<Mat4> randomMatrices(size_t count) {
+  std::mt19937 rng{seed};
+  std::uniform_real_distribution<float> dist{-1.f, 1.f};
+  std::vector<Mat4> matrices(count);
+  for (auto &m : matrices)
+    for (auto &row : m.data)
+      row = {dist(rng), dist(rng), dist(rng), dist(rng)};
+  return matrices;
+}
+
+Result benchMatMat() {
+  constexpr auto count = 1uz << 12;
+  auto matrices = randomMatrices(count);
+  auto ns = fastest([&] {
+    for (auto i = 0uz; i + 1 < count; ++i)
+      keep(matrices[i] * matrices[i + 1]);
+  });
+  return {.ns_per_op = ns / (count - 1)};
+}
+
+Result benchMatVec() {
+  constexpr auto count = 1uz << 12;
+  auto matrices = randomMatrices(count);
+  auto ns = fastest([&] {
+    for (auto i = 0uz; i < count; ++i)
+      keep(matrices[i] * matrices[count - 1 - i][0]);
+  });
+  return {.ns_per_op = ns / count};
+}
+
+using BenchTexture = Texture<UNorm, Blocked<8>>;
+
+BenchTexture randomTexture(Filter filter) {
+  constexpr unsigned size{512};
+  std::mt19937 rng{seed};
+  std::vector<UNorm> texels(size * size);
+  for (auto &texel : texels)
+    texel = static_cast<unsigned>(rng());
+  BenchTexture tex{size, size, texels};
+  tex.setFilter(filter);
+  return tex;
+}
+
+// Samples random coordinates, in quads of neighbouring ones a texel apart for
+// packets.
+Result benchSample(Filter filter, bool packet) {
+  constexpr auto count = 1uz << 16;
+  auto tex = randomTexture(filter);
+  std::mt19937 rng{seed};
+  std::uniform_real_distribution<float> dist{0.f, 1.f};
+  std::vector<float> us(count);
+  std::vector<float> vs(count);
+  for (auto i = 0uz; i < count; i += 4) {
+    auto u = dist(rng);
+    auto v = dist(rng);
+    auto step = 1.f / tex.getWidth();
+    for (auto j = 0u; j < 4; ++j) {
+      us[i + j] = u + (j & 1) * step;
+      vs[i + j] = v + (j >> 1) * step;
+    }
+  }
+
+  std::vector<Float8> us8;
+  std::vector<Float8> vs8;
+  for (auto i = 0uz; i < count; i += 8) {
+    alignas(32) float lanes[8];
+    std::copy_n(&us[i], 8, lanes);
+    us8.push_back(Float8::load(lanes));
+    std::copy_n(&vs[i], 8, lanes);
+    vs8.push_back(Float8::load(lanes));
+  }
+
+  auto ns = fastest([&] {
+    if (packet) {
+      for (auto i = 0uz; i < us8.size(); ++i)
+        keep(tex.sample(us8[i], vs8[i]));
+    } else {
+      for (auto i = 0uz; i < count; ++i)
+        keep(tex.sample(us[i], vs[i]));
+    }
+  });
+  return {.ns_per_op = ns / count, .pixels_per_s = count / ns * 1e9};
+}
+
+Result benchParseObj() {
+  size_t triangles = 0;
+  auto ns = fastest([&] { triangles = app::parseObj(ASSETS_DIR "/teapot.obj").size() / 3; });
+  return {.ns_per_op = ns, .triangles_per_s = triangles / ns * 1e9};
+}
+
+// Maps a converted teapot and reads every vertex, as a draw would.
+Result benchLoadMesh() {
+  auto path = (std::filesystem::temp_directory_path() / "renderer_bench_teapot.mesh").string();
+  auto mesh = app::parseObjIndexed(ASSETS_DIR "/teapot.obj");
+  app::saveMesh(path, mesh.vertices, mesh.indices);
+  auto ns = fastest([&] {
+    app::MeshFile file{path};
+    auto &vb = file.getVertexBuffer();
+    auto sum = 0.f;
+    for (auto i = 0uz; i < vb.count; ++i)
+      sum += static_cast<const app::ObjVertex *>(vb.ptr)[i].pos.x;
+    keep(sum);
+  });
+  std::filesystem::remove(path);
+  return {.ns_per_op = ns, .triangles_per_s = mesh.indices.size() / 3 / ns * 1e9};
+}
+
+Result benchLoadTGA() {
+  size_t pixels = 0;
+  auto ns = fastest([&] { pixels = app::loadTGA(ASSETS_DIR "/stormtrooper_d.tga").size(); });
+  return {.ns_per_op = ns, .pixels_per_s = pixels / ns * 1e9};
+}
+
+std::vector<Benchmark> benchmarks() {
+  std::vector<Benchmark> list{
+      {"setup_edge", benchSetupEdge},
+      {"precomputeAttrs/8", [] { return benchPrecomputeAttrs(8); }},
+      {"precomputeAttrs/16", [] { return benchPrecomputeAttrs(16); }},
+      {"fill/line", [] { return benchFill(true); }},
+      {"fill/triangle", [] { return benchFill(false); }},
+  };
+  for (auto size : {2, 8, 32, 128}) {
+    auto name = "rasterizeTriHalfSpace/" + std::to_string(size) + "px";
+    list.push_back({name + "/scalar", [size] { return benchRasterize(size, false); }});
+    list.push_back({name + "/packet", [size] { return benchRasterize(size, true); }});
+  }
+  using enum FrameBuffer::DepthFormat;
+  list.push_back({"depthFormat/D32F", [] { return benchDepthFormat(D32F); }});
+  list.push_back({"depthFormat/D24", [] { return benchDepthFormat(D24); }});
+  list.push_back({"depthFormat/D16", [] { return benchDepthFormat(D16); }});
+  list.push_back({"Mat4*Mat4", benchMatMat});
+  list.push_back({"Mat4*Vec4", benchMatVec});
+  list.push_back({"Texture::sample/nearest", [] { return benchSample(Filter::Nearest, false); }});
+  list.push_back({"Texture::sample/bilinear", [] { return benchSample(Filter::Bilinear, false); }});
+  list.push_back(
+      {"Texture::sample/bilinear_packet", [] { return benchSample(Filter::Bilinear, true); }});
+  list.push_back(
+      {"Texture::sample/trilinear_packet", [] { return benchSample(Filter::Trilinear, true); }});
+  list.push_back({"parseObj/teapot", benchParseObj});
+  list.push_back({"loadMesh/teapot", benchLoadMesh});
+  list.push_back({"loadTGA/stormtrooper_d", benchLoadTGA});
+  return list;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string filter = argc > 1 ? argv[1] : "";
+  try {
+    std::printf("{\n  \"benchmarks\": [");
+    auto first = true;
+    for (auto &bench : benchmarks()) {
+      if (bench.name.find(filter) == std::string::npos)
+        continue;
+      auto result = bench.run();
+      std::printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.3f", first ? "" : ",",
+                  bench.name.c_str(), result.ns_per_op);
+      if (result.pixels_per_s)
+        std::printf(", \"pixels_per_s\": %.0f", result.pixels_per_s);
+      if (result.triangles_per_s)
+        std::printf(", \"triangles_per_s\": %.0f", result.triangles_per_s);
+      if (result.differing_pixels)
+        std::printf(", \"differing_pixels\": %zu", result.differing_pixels);
+      std::printf("}");
+      std::fflush(stdout);
+      first = false;
+    }
+    std::printf("\n  ]\n}\n");
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+}
@@ -1,25 +1,28 @@
 #include "app/app.h"
 #include "app/obj_parser.h"
+#include "renderer/raster_impl.h"
 
 using namespace renderer;
 
 namespace {
 
-struct MyProgram : Program {
+// Drawn with draw<MyProgram>(), so the fragment shader inlines into the
+// rasterizer.
+struct MyProgram {
+  struct Attr {};
   struct Uniform {
     Mat4 mvp;
   };
 
-  static void vertexShader(const Vertex &in, const void *u, VertexH &out) {
-    auto uin = static_cast<const Uniform *>(u);
-    out.pos = uin->mvp * Vec4{in.pos, 1.f};
+  static void vs(const Vertex &in, const Uniform &u, Vec4 &pos, Attr &) {
+    pos = u.mvp * Vec4{in.pos, 1.f};
   }
 
-  static void fragmentShader(const Fragment &, const void *, Vec4 &out) {
+  static void fs(const Vec3 &, const Attr &, const Uniform &, Vec4 &out) {
     out = {1.f, 1.f, 1.f, 1.f};
   }
 
-  MyProgram() : Program{.vs = vertexShader, .fs = fragmentShader, .attr_count = 0} {}
+  static Mat4 clipTransform(const Uniform &u) { return u.mvp; }
 };
 
 } // namespace
@@ -31,7 +34,6 @@ public:
 private:
   void startup() override {
     ctx_.setVertexBuffer(&vb_);
-    ctx_.setProgram(&prog_);
     ctx_.setUniform(&uniform_);
     ctx_.setWireframeMode(true);
 
@@ -45,25 +47,26 @@ private:
 
     uniform_.mvp = proj_view_ * model_[0] * rotateY(time * 0.3f);
     ctx_.setCulling(Pipeline::Culling::BackFacing);
-    ctx_.draw();
+    ctx_.draw<MyProgram>();
 
     uniform_.mvp = proj_view_ * rotateY(time * 0.3f);
     ctx_.setCulling(Pipeline::Culling::None);
-    ctx_.draw();
+    ctx_.draw<MyProgram>();
 
     uniform_.mvp = proj_view_ * model_[1] * rotateY(time * 0.3f);
     ctx_.setCulling(Pipeline::Culling::FrontFacing);
-    ctx_.draw();
+    ctx_.draw<MyProgram>();
   }
 
   std::vector<app::ObjVertex> vertices_{app::parseObj(ASSETS_DIR "/monkey.obj")};
+  Aabb bounds_{app::computeBounds(vertices_)};
   VertexBuffer vb_{.ptr = &vertices_[0],
                    .count = static_cast<unsigned>(vertices_.size()),
-                   .stride = sizeof(vertices_[0])};
+                   .stride = sizeof(vertices_[0]),
+                   .bounds = &bounds_};
   Mat4 model_[2]{translate({-3.f, 0.f, 0.f}), translate({3.f, 0.f, 0.f})};
   Mat4 proj_view_;
   MyProgram::Uniform uniform_;
-  MyProgram prog_;
 };
 
 DEFINE_AND_CALL_APP(CullingApp, 1200, 900, Culling)
@@ -0,0 +1,159 @@
+#include <format>
+#include <iostream>
+
+#include "app/app.h"
+
+using namespace renderer;
+
+namespace {
+
+struct MyVertex : Vertex {
+  MyVertex(const Vec3 &pos, const Vec3 &color) : Vertex{pos}, color{color} {}
+  Vec3 color;
+};
+
+struct MyProgram : Program {
+  struct Attr {
+    Vec3 color;
+  };
+
+  struct Uniform {
+    Mat4 mvp;
+  };
+
+  static void vertexShader(const Vertex &in, const void *u, VertexH &out) {
+    auto &vin = static_cast<const MyVertex &>(in);
+    auto &uin = *static_cast<const Uniform *>(u);
+    auto &aout = *static_cast<Attr *>(out.attr);
+
+    out.pos = uin.mvp * Vec4{in.pos, 1.f};
+    aout.color = vin.color;
+  }
+
+  static void fragmentShader(const Fragment &in, const void *, Vec4 &out) {
+    auto &ain = *static_cast<const Attr *>(in.attr);
+    out = {ain.color, 1.f};
+  }
+
+  MyProgram() : Program{.vs = vertexShader, .fs = fragmentShader, .attr_count = 3} {}
+};
+
+// Pushes the two triangles of a quad in the y = height plane.
+void addQuad(std::vector<MyVertex> &verts, float x0, float z0, float x1, float z1, float height,
+             const Vec3 &color) {
+  verts.insert(verts.end(), {{{x0, height, z0}, color},
+                             {{x1, height, z0}, color},
+                             {{x1, height, z1}, color},
+                             {{x0, height, z0}, color},
+                             {{x1, height, z1}, color},
+                             {{x0, height, z1}, color}});
+}
+
+} // namespace
+
+// Draws a floor with decals lying just above it, into a framebuffer of each
+// depth format, and counts the pixels where a format shows something else than
+// D32F: where the floor pokes through a decal, i.e. z-fighting. Once a second
+// the average count and rasterization time of each format is printed. D cycles
+// the format displayed, the differing pixels marked red.
+class DepthPrecisionApp : public app::App {
+public:
+  using App::App;
+
+private:
+  constexpr static FrameBuffer::DepthFormat formats[]{
+      FrameBuffer::DepthFormat::D32F, FrameBuffer::DepthFormat::D24,
+      FrameBuffer::DepthFormat::D16};
+  constexpr static const char *format_names[]{"D32F", "D24", "D16"};
+  constexpr static auto format_count = std::size(formats);
+
+  void startup() override {
+    ctx_.setVertexBuffer(&vb_);
+    ctx_.setProgram(&prog_);
+    ctx_.setUniform(&uniform_);
+
+    addQuad(vertices_, -20.f, 0.f, 20.f, -80.f, 0.f, {.4f, .4f, .4f});
+    for (auto i = 1; i < 40; ++i) {
+      auto x = i % 2 ? -1.5f : .5f;
+      auto z = -2.f * i;
+      Vec3 color{i % 3 == 0 ? .9f : .2f, i % 3 == 1 ? .9f : .2f, i % 3 == 2 ? .9f : .2f};
+      addQuad(vertices_, x, z, x + 1.f, z - 1.f, decal_offset, color);
+    }
+    vb_ = {.ptr = &vertices_[0], .count = vertices_.size(), .stride = sizeof(MyVertex)};
+
+    for (auto format : formats)
+      fbs_.emplace_back(width_, height_, format);
+    proj_ = createPerspProjMatrix(70.0_deg, static_cast<float>(width_) / height_, .02f, 200.f);
+  }
+
+  void renderLoop(double time, double delta) override {
+    auto eye_y = 1.7f + .3f * std::sin(static_cast<float>(time) * .5f);
+    auto view = createViewMatrix({0.f, eye_y, 2.f}, {0.f, .5f, -20.f}, {0.f, 1.f, 0.f});
+    uniform_.mvp = proj_ * view;
+
+    for (auto i = 0uz; i < format_count; ++i) {
+      ctx_.setFrameBuffer(&fbs_[i]);
+      fbs_[i].clear();
+      auto raster_ms = ctx_.getStats().raster_ms;
+      ctx_.draw();
+      raster_ms_[i] += ctx_.getStats().raster_ms - raster_ms;
+    }
+    ctx_.setFrameBuffer(&fb_);
+
+    // Compare with D32F and show the chosen format.
+    auto &reference = fbs_[0].getColorTexture();
+    for (auto i = 1uz; i < format_count; ++i) {
+      auto &color = fbs_[i].getColorTexture();
+      for (auto y = 0u; y < height_; ++y) {
+        for (auto x = 0u; x < width_; ++x) {
+          auto differs = color.getSpan(x, y)->rgba != reference.getSpan(x, y)->rgba;
+          fighting_[i] += differs;
+          if (i == shown_)
+            fb_.setPixel(x, y, differs ? Vec4{1.f, 0.f, 0.f, 1.f} : color.fetchTexel(x, y), 1.f);
+        }
+      }
+    }
+    if (shown_ == 0) {
+      for (auto y = 0u; y < height_; ++y)
+        for (auto x = 0u; x < width_; ++x)
+          fb_.setPixel(x, y, reference.fetchTexel(x, y), 1.f);
+    }
+
+    ++frames_;
+    elapsed_ += delta;
+    if (elapsed_ < 1.)
+      return;
+    for (auto i = 0uz; i < format_count; ++i) {
+      std::cout << std::format("{}: {:.2f} ms, {} px z-fighting{}", format_names[i],
+                               raster_ms_[i] / frames_, fighting_[i] / frames_,
+                               i + 1 < format_count ? "; " : "\n");
+      raster_ms_[i] = 0.;
+      fighting_[i] = 0;
+    }
+    frames_ = 0;
+    elapsed_ = 0.;
+  }
+
+  void onKeyDown(SDL_Keycode key) override {
+    if (key == SDLK_D)
+      shown_ = (shown_ + 1) % format_count;
+  }
+
+  // Far enough above the floor to be resolved by D32F up close, but not by
+  // D16 beyond a few meters.
+  constexpr static float decal_offset{.005f};
+
+  std::vector<MyVertex> vertices_;
+  VertexBuffer vb_;
+  std::vector<FrameBuffer> fbs_;
+  Mat4 proj_;
+  MyProgram::Uniform uniform_;
+  MyProgram prog_;
+  size_t shown_{};
+  double raster_ms_[format_count]{};
+  size_t fighting_[format_count]{};
+  unsigned frames_{};
+  double elapsed_{};
+};
+
+DEFINE_AND_CALL_APP(DepthPrecisionApp, 1200, 900, DepthPrecision)
@@ -1,4 +1,8 @@
 #include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <thread>
+#include <vector>
 
 #include "app/app.h"
 #include "app/obj_parser.h"
@@ -13,12 +17,55 @@ constexpr auto height = 900;
 
 namespace {
 
+// The G-buffer color, cleared lazily per 8x8 block like FrameBuffer: clear()
+// only starts a new frame, a block's texels are zeroed when it is first written
+// to in the frame, and those of blocks left alone read as zero. Tiles are made
+// of whole blocks, so every block is written by a single rasterizer thread.
+class ColorTarget {
+public:
+  ColorTarget(unsigned width, unsigned height)
+      : texture_{width, height}, blocks_x_{(width + block_size - 1) / block_size},
+        frames_(static_cast<size_t>(blocks_x_) * ((height + block_size - 1) / block_size)) {}
+
+  void clear() { ++frame_; }
+
+  void setTexel(unsigned x, unsigned y, const Vec4 &color) {
+    auto &frame = frames_[blockIndex(x, y)];
+    if (frame != frame_) {
+      // The texels of a block are contiguous.
+      std::fill_n(texture_.getSpan(x & ~(block_size - 1), y & ~(block_size - 1)),
+                  block_size * block_size, UNorm{0u});
+      frame = frame_;
+    }
+    texture_.setTexel(x, y, color);
+  }
+
+  [[nodiscard]] Vec4 fetchTexel(unsigned x, unsigned y) const {
+    return frames_[blockIndex(x, y)] == frame_ ? texture_.fetchTexel(x, y) : Vec4{};
+  }
+
+private:
+  constexpr static unsigned block_size{8};
+
+  [[nodiscard]] size_t blockIndex(unsigned x, unsigned y) const {
+    return static_cast<size_t>(y / block_size) * blocks_x_ + x / block_size;
+  }
+
+  Texture<UNorm, Blocked<block_size>> texture_;
+  unsigned blocks_x_;
+  std::vector<uint32_t> frames_; // Frame each block was last written in.
+  uint32_t frame_{1};
+};
+
 struct DeferredStage1 : Program {
-  struct Uniform {
+  struct Instance {
     Mat4 mv;
     Mat4 mvp;
-    Texture<UNorm> tex_diff;
-    Texture<UNorm> *rt_color;
+  };
+
+  struct Uniform {
+    Texture<UNorm, Blocked<8>> tex_diff;
+    ColorTarget *rt_color;
     Texture<Vec3> *rt_normal;
     Texture<Vec3> *rt_pos_v;
   };
@@ -29,14 +76,15 @@ struct DeferredStage1 : Program {
     Vec2 tc;
   };
 
-  static void vertexShader(const Vertex &in, const void *u, VertexH &out) {
+  static void vertexShader(const Vertex &in, const void *, unsigned, const void *instance,
+                           VertexH &out) {
     auto &vin = static_cast<const ObjVertex &>(in);
-    auto &uin = *static_cast<const Uniform *>(u);
+    auto &iin = *static_cast<const Instance *>(instance);
     auto &aout = *static_cast<Attr *>(out.attr);
 
-    auto n = uin.mv * Vec4{vin.normal, 0.f};
-    auto pv = uin.mv * Vec4{in.pos, 1.f};
-    out.pos = uin.mvp * Vec4{in.pos, 1.f};
+    auto n = iin.mv * Vec4{vin.normal, 0.f};
+    auto pv = iin.mv * Vec4{in.pos, 1.f};
+    out.pos = iin.mvp * Vec4{in.pos, 1.f};
     aout.normal = {n.x, n.y, n.z};
     aout.pos_v = {pv.x, pv.y, pv.z};
     aout.tc = vin.tc;
@@ -53,12 +101,49 @@ struct DeferredStage1 : Program {
     uin.rt_pos_v->setTexel(x, y, ain.pos_v);
   }
 
-  DeferredStage1() : Program{.vs = vertexShader, .fs = fragmentShader, .attr_count = 8} {}
+  // Shades in quads, so that the diffuse map is read from the mip level that
+  // matches the distance of the model.
+  static void packetFragmentShader(const FragmentPacket &in, const void *u, Vec4x8 &) {
+    auto &uin = *static_cast<const Uniform *>(u);
+    auto color = uin.tex_diff.sample(in.attr[6], in.attr[7]);
+    auto normal = normalize(Vec3x8{in.attr[0], in.attr[1], in.attr[2]});
+
+    alignas(32) float lanes[12][8];
+    const Float8 *values[] = {&in.x,     &in.y,     &color.x,   &color.y,   &color.z,   &color.w,
+                              &normal.x, &normal.y, &normal.z, &in.attr[3], &in.attr[4],
+                              &in.attr[5]};
+    for (auto i = 0u; i < std::size(values); ++i)
+      values[i]->store(lanes[i]);
+
+    for (auto mask = in.mask; mask; mask &= mask - 1) {
+      auto i = std::countr_zero(mask);
+      auto x = static_cast<unsigned>(lanes[0][i]);
+      auto y = static_cast<unsigned>(lanes[1][i]);
+      uin.rt_color->setTexel(x, y, {lanes[2][i], lanes[3][i], lanes[4][i], lanes[5][i]});
+      uin.rt_normal->setTexel(x, y, {lanes[6][i], lanes[7][i], lanes[8][i]});
+      uin.rt_pos_v->setTexel(x, y, {lanes[9][i], lanes[10][i], lanes[11][i]});
+    }
+  }
+
+  // Models out of view are skipped before their vertices are shaded.
+  static Mat4 clipTransform(const void *, const void *instance) {
+    return static_cast<const Instance *>(instance)->mvp;
+  }
+
+  // Only drawn instanced, one instance per model.
+  DeferredStage1()
+      : Program{.vs = nullptr,
+                .fs = fragmentShader,
+                .attr_count = 8,
+                .fs_packet = packetFragmentShader,
+                .fs_quads = true,
+                .vs_instance = vertexShader,
+                .clip_transform = clipTransform} {}
 };
 
 struct DeferredStage2 : Program {
   struct Uniform {
-    const Texture<UNorm> *rt_color;
+    const ColorTarget *rt_color;
     const Texture<Vec3> *rt_normal;
     const Texture<Vec3> *rt_pos_v;
   };
@@ -99,37 +184,49 @@ struct DeferredStage2 : Program {
 
 class MRTApp : public App {
 public:
-  MRTApp(unsigned w, unsigned h, const std::string &name)
-      : App{w, h, name}, model_{parseObj(ASSETS_DIR "/stormtrooper.obj")},
+  MRTApp(unsigned w, unsigned h, const std::string &name, const Options &options)
+      : App{w, h, name, options}, model_{parseObjIndexed(ASSETS_DIR "/stormtrooper.obj")},
         quad_{{{-1.f, -1.f, -1.f}}, {{1.f, -1.f, -1.f}}, {{-1.f, 1.f, -1.f}},
               {{-1.f, 1.f, -1.f}},  {{1.f, -1.f, -1.f}}, {{1.f, 1.f, -1.f}}},
-        vb_model_{.ptr = &model_[0], .count = model_.size(), .stride = sizeof(model_[0])},
+        vb_model_{.ptr = &model_.vertices[0],
+                  .count = model_.vertices.size(),
+                  .stride = sizeof(model_.vertices[0]),
+                  .bounds = &model_.bounds},
+        ib_model_{.ptr = &model_.indices[0],
+                  .count = model_.indices.size(),
+                  .type = IndexBuffer::Type::U32},
         vb_quad_{.ptr = &quad_[0], .count = quad_.size(), .stride = sizeof(quad_[0])},
         rt_color{w, h}, rt_normal{w, h}, rt_pos_v{w, h},
-        uniform1_{.mv = {},
-                  .mvp = {},
-                  .tex_diff = {1024, 1024, loadTGA(ASSETS_DIR "/stormtrooper_d.tga")},
+        uniform1_{.tex_diff = {1024, 1024},
                   .rt_color = &rt_color,
                   .rt_normal = &rt_normal,
                   .rt_pos_v = &rt_pos_v},
-        uniform2_{.rt_color = &rt_color, .rt_normal = &rt_normal, .rt_pos_v = &rt_pos_v} {}
+        uniform2_{.rt_color = &rt_color, .rt_normal = &rt_normal, .rt_pos_v = &rt_pos_v} {
+    loadTGA(ASSETS_DIR "/stormtrooper_d.tga", uniform1_.tex_diff);
+  }
 
 private:
   void startup() override {
     ctx_.setCulling(Pipeline::Culling::BackFacing);
+    ctx_.setThreadCount(std::thread::hardware_concurrency());
 
-    rt_color.clear();
     rt_normal.clear();
     rt_pos_v.clear();
+    uniform1_.tex_diff.setFilter(Filter::Bilinear);
 
     proj_ = createPerspProjMatrix(70.0_deg, static_cast<float>(width_) / height_, 1.f, 100.f);
   }
 
+  void onKeyDown(SDL_Keycode key) override {
+    if (key == SDLK_P)
+      prepass_ = !prepass_;
+  }
+
   void renderLoop(double time, double) override {
+    // The lighting pass only reads normals and positions where the G-buffer
+    // pass wrote a color, so those targets need no clear; the color's is lazy.
     fb_.clear();
     rt_color.clear();
-    rt_normal.clear();
-    rt_pos_v.clear();
 
     float px = std::sin(time * 0.3f) * 3.5f;
     float py = std::cos(time * 0.3f) * 0.2f + 0.7f;
@@ -139,36 +236,55 @@ private:
     fb_.setColorWrite(false);
     ctx_.setUniform(&uniform1_);
     ctx_.setVertexBuffer(&vb_model_);
+    ctx_.setIndexBuffer(&ib_model_);
     ctx_.setProgram(&prog1_);
 
-    for (auto i = -5; i <= 5; i += 2) {
-      for (auto j = -5; j <= 5; ++j) {
+    // Rows nearest to the camera first, so that the ones behind them are mostly
+    // rejected by the depth test before reaching the fragment shader.
+    instances_.clear();
+    for (auto j = 5; j >= -5; --j) {
+      for (auto i = -5; i <= 5; i += 2) {
         auto model = translate(Vec3(i, 0.f, j));
-        uniform1_.mv = view * model;
-        uniform1_.mvp = proj_ * view * model;
-        ctx_.draw();
+        instances_.push_back({.mv = view * model, .mvp = proj_ * view * model});
       }
     }
+    auto draw_grid = [&] {
+      ctx_.drawInstanced(instances_.size(), instances_.data(), sizeof(instances_[0]));
+    };
+
+    // With the prepass on, the G-buffer pass only shades the visible surface;
+    // the frag counter in the HUD shows the difference.
+    if (prepass_) {
+      ctx_.setPass(Pipeline::Pass::DepthOnly);
+      draw_grid();
+      ctx_.setPass(Pipeline::Pass::Shading);
+    }
+    draw_grid();
 
     fb_.setColorWrite(true);
+    ctx_.setPass(Pipeline::Pass::Full);
     ctx_.setVertexBuffer(&vb_quad_);
+    ctx_.setIndexBuffer(nullptr);
     ctx_.setUniform(&uniform2_);
     ctx_.setProgram(&prog2_);
     ctx_.draw();
   }
 
-  std::vector<ObjVertex> model_;
+  ObjMesh model_;
   std::vector<Vertex> quad_;
   VertexBuffer vb_model_;
+  IndexBuffer ib_model_;
   VertexBuffer vb_quad_;
-  Texture<UNorm> rt_color;
+  ColorTarget rt_color;
   Texture<Vec3> rt_normal;
   Texture<Vec3> rt_pos_v;
+  std::vector<DeferredStage1::Instance> instances_;
   DeferredStage1::Uniform uniform1_;
   DeferredStage2::Uniform uniform2_;
   DeferredStage1 prog1_;
   DeferredStage2 prog2_;
   Mat4 proj_;
+  bool prepass_{};
 };
 
 DEFINE_AND_CALL_APP(MRTApp, width, height, Multiple Render Targets)
@@ -19,7 +19,7 @@ struct MyProgram : Program {
   struct Uniform {
     Mat4 mv;
     Mat4 mvp;
-    Texture<UNorm> tex;
+    Texture<UNorm, Blocked<8>> tex;
   };
 
   static void vertexShader(const Vertex &in, const void *u, VertexH &out) {
@@ -55,7 +55,33 @@ struct MyProgram : Program {
     out = ambient + diffuse + specular;
   }
 
-  MyProgram() : Program{.vs = vertexShader, .fs = fragmentShader, .attr_count = 8} {}
+  static void packetFragmentShader(const FragmentPacket &in, const void *u, Vec4x8 &out) {
+    const static Vec3 to_light = normalize({0.5f, 1.f, 1.f});
+    const static Vec4 ambient_albedo{.1f, .1f, .1f, 1.f};
+    const static Vec4 diffuse_albedo{.7f, .7f, .7f, 1.f};
+    const static Vec4 specular_albedo{.2f, .2f, .2f, 1.f};
+    const static unsigned spec_power = 64;
+    auto &uin = *static_cast<const Uniform *>(u);
+    Vec3x8 normal{in.attr[0], in.attr[1], in.attr[2]};
+    Vec3x8 pos_v{in.attr[3], in.attr[4], in.attr[5]};
+
+    auto to_eye = normalize(-pos_v);
+    auto n = normalize(normal);
+    auto tex = uin.tex.sample(in.attr[6], in.attr[7]);
+    auto ambient = tex * ambient_albedo;
+    auto diffuse = tex * diffuse_albedo * max(dot(n, to_light), 0.f);
+    auto specular = Vec4x8{specular_albedo} *
+                    pow(max(dot(reflect(-to_light, n), to_eye), 0.f), spec_power);
+
+    out = ambient + diffuse + specular;
+  }
+
+  MyProgram()
+      : Program{.vs = vertexShader,
+                .fs = fragmentShader,
+                .attr_count = 8,
+                .fs_packet = packetFragmentShader,
+                .fs_quads = true} {}
 };
 
 auto genCheckerTexture(unsigned width, unsigned height, unsigned step) {
@@ -81,8 +107,8 @@ auto genCheckerTexture(unsigned width, unsigned height, unsigned step) {
 
 class TexturingApp : public app::App {
 public:
-  TexturingApp(unsigned w, unsigned h, const std::string &name)
-      : App{w, h, name}, vertices_{app::parseObj(ASSETS_DIR "/cube.obj")},
+  TexturingApp(unsigned w, unsigned h, const std::string &name, const app::Options &options)
+      : App{w, h, name, options}, vertices_{app::parseObj(ASSETS_DIR "/cube.obj")},
         vb_{.ptr = &vertices_[0], .count = vertices_.size(), .stride = sizeof(vertices_[0])},
         uniform_{.mv = {}, .mvp = {}, .tex = {512, 512, genCheckerTexture(512, 512, 64)}} {}
 
@@ -92,6 +118,7 @@ private:
     ctx_.setProgram(&prog_);
     ctx_.setUniform(&uniform_);
     ctx_.setCulling(Pipeline::Culling::BackFacing);
+    uniform_.tex.setFilter(Filter::Bilinear);
 
     view_ = createViewMatrix({0.f, 0.f, 3.7f}, {0.f, 0.f, 0.f}, {0.f, 1.f, 0.f});
     auto proj = createPerspProjMatrix(70.0_deg, static_cast<float>(width_) / height_, 1.f, 100.f);
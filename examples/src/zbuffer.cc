@@ -2,6 +2,7 @@
 
 #include "app/app.h"
 #include "app/obj_parser.h"
+#include "renderer/command_list.h"
 
 using namespace renderer;
 
@@ -47,43 +48,94 @@ struct MyProgram : Program {
     out = {ambient_albedo + diffuse + specular, 1.f};
   }
 
-  MyProgram() : Program{.vs = vertexShader, .fs = fragmentShader, .attr_count = 6} {}
+  static void packetFragmentShader(const FragmentPacket &in, const void *, Vec4x8 &out) {
+    const static Vec3 to_light = normalize({0.5f, 1.f, 1.f});
+    const static Vec3 ambient_albedo{.1f, .1f, .1f};
+    const static Vec3 diffuse_albedo{.8f, .8f, .8f};
+    const static Vec3 specular_albedo{.3f, .3f, .3f};
+    const static unsigned spec_power = 64;
+    Vec3x8 normal{in.attr[0], in.attr[1], in.attr[2]};
+    Vec3x8 pos_v{in.attr[3], in.attr[4], in.attr[5]};
+
+    auto to_eye = normalize(-pos_v);
+    auto n = normalize(normal);
+    auto diffuse = Vec3x8{diffuse_albedo} * max(dot(n, to_light), 0.f);
+    auto specular = Vec3x8{specular_albedo} *
+                    pow(max(dot(reflect(-to_light, n), to_eye), 0.f), spec_power);
+
+    out = {Vec3x8{ambient_albedo} + diffuse + specular, 1.f};
+  }
+
+  MyProgram()
+      : Program{.vs = vertexShader,
+                .fs = fragmentShader,
+                .attr_count = 6,
+                .fs_packet = packetFragmentShader} {}
 };
 
 } // namespace
 
+namespace renderer {
+
+// Replays hash the uniform, see CommandList::setUniform.
+template <>
+constexpr bool has_unique_bytes<MyProgram::Uniform> =
+    has_unique_bytes<Mat4> && sizeof(MyProgram::Uniform) == 2 * sizeof(Mat4);
+
+} // namespace renderer
+
 class ZBufferApp : public app::App {
 public:
   using App::App;
 
 private:
   void startup() override {
-    ctx_.setVertexBuffer(&vb_);
-    ctx_.setProgram(&prog_);
-    ctx_.setUniform(&uniform_);
+    list_.setVertexBuffer(&vb_);
+    list_.setIndexBuffer(&ib_);
+    list_.setProgram(&prog_);
+    list_.setUniform(&uniform_);
+    list_.draw();
 
     view_ = createViewMatrix({0.f, 1.1f, 3.7f}, {0.f, 1.f, 0.f}, {0.f, 1.f, 0.f});
     auto proj = createPerspProjMatrix(70.0_deg, static_cast<float>(width_) / height_, 1.f, 100.f);
     proj_view_ = proj * view_;
   }
 
+  // Space stops the teapot, so that the uniform stays the same and replays
+  // reuse the transformed triangles.
+  void onKeyDown(SDL_Keycode key) override {
+    if (key == SDLK_SPACE)
+      paused_ = !paused_;
+  }
+
   void renderLoop(double time, double) override {
     fb_.clear();
 
-    auto model = rotateX(std::sin(time * 0.4f) * 0.15f + 0.2f) * rotateY(time * .5f);
+    if (paused_)
+      time_offset_ = time - anim_time_;
+    else
+      anim_time_ = time - time_offset_;
+    auto model = rotateX(std::sin(anim_time_ * 0.4f) * 0.15f + 0.2f) * rotateY(anim_time_ * .5f);
     uniform_.mv = view_ * model;
     uniform_.mvp = proj_view_ * model;
-    ctx_.draw();
+    ctx_.replay(list_);
   }
 
-  std::vector<app::ObjVertex> vertices_{app::parseObj(ASSETS_DIR "/teapot.obj")};
-  VertexBuffer vb_{.ptr = &vertices_[0],
-                   .count = static_cast<unsigned>(vertices_.size()),
-                   .stride = sizeof(vertices_[0])};
+  app::ObjMesh mesh_{app::parseObjIndexed(ASSETS_DIR "/teapot.obj")};
+  VertexBuffer vb_{.ptr = &mesh_.vertices[0],
+                   .count = mesh_.vertices.size(),
+                   .stride = sizeof(mesh_.vertices[0])};
+  IndexBuffer ib_{.ptr = &mesh_.indices[0],
+                  .count = mesh_.indices.size(),
+                  .type = IndexBuffer::Type::U32};
   MyProgram prog_;
   MyProgram::Uniform uniform_;
+  CommandList list_;
   Mat4 view_;
   Mat4 proj_view_;
+  bool paused_{};
+  double anim_time_{};
+  double time_offset_{};
 };
 
 DEFINE_AND_CALL_APP(ZBufferApp, 1200, 900, ZBuffer)
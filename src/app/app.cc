@@ -1,9 +1,23 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
 #include <format>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <font8x8_basic.h>
 
 #include "app/app.h"
+#include "app/ppm.h"
 
 namespace app {
 
@@ -29,10 +43,165 @@ void drawText(renderer::FrameBuffer &fb, unsigned x, unsigned y, unsigned scale,
   }
 }
 
+// FNV-1a.
+uint64_t hashImage(const Image &image) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto &pix : image.pixels) {
+    for (auto c : {pix.r, pix.g, pix.b}) {
+      hash ^= c;
+      hash *= 0x100000001b3;
+    }
+  }
+  return hash;
+}
+
+size_t countDifferingPixels(const Image &a, const Image &b, unsigned tolerance) {
+  if (a.width != b.width || a.height != b.height)
+    return std::max(a.pixels.size(), b.pixels.size());
+  auto differs = [=](int x, int y) { return static_cast<unsigned>(std::abs(x - y)) > tolerance; };
+  size_t count = 0;
+  for (auto i = 0uz; i < a.pixels.size(); ++i) {
+    auto &pa = a.pixels[i];
+    auto &pb = b.pixels[i];
+    count += differs(pa.r, pb.r) || differs(pa.g, pb.g) || differs(pa.b, pb.b);
+  }
+  return count;
+}
+
+// Runs frames on a thread that lives as long as it does, one at a time:
+// start() hands it the next frame, wait() returns once it is done and rethrows
+// whatever the frame threw. Whatever the frame reads is the caller's to write
+// between wait() and start().
+class FrameThread {
+public:
+  explicit FrameThread(std::function<void()> frame)
+      : frame_{std::move(frame)}, thread_{&FrameThread::work, this} {}
+  ~FrameThread() {
+    {
+      std::lock_guard lock{mutex_};
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+  FrameThread(const FrameThread &) = delete;
+  FrameThread &operator=(const FrameThread &) = delete;
+
+  void start() {
+    {
+      std::lock_guard lock{mutex_};
+      pending_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock lock{mutex_};
+    cv_.wait(lock, [this] { return !pending_; });
+    if (auto error = std::exchange(error_, nullptr))
+      std::rethrow_exception(error);
+  }
+
+private:
+  void work() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || pending_; });
+      if (stop_)
+        return;
+      lock.unlock();
+      try {
+        frame_();
+      } catch (...) {
+        error_ = std::current_exception();
+      }
+      lock.lock();
+      pending_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  std::function<void()> frame_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool pending_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread thread_; // Last, so that the rest is set up when it starts.
+};
+
+double median(std::vector<double> values) {
+  auto mid = values.begin() + static_cast<std::ptrdiff_t>(values.size() / 2);
+  std::ranges::nth_element(values, mid);
+  return *mid;
+}
+
+// Frame times, in ms, of a baseline written by App::replay().
+std::vector<double> loadBaseline(const std::string &path) {
+  std::ifstream ifs(path);
+  if (!ifs.good())
+    throw Error{"failed to open baseline '" + path + '\''};
+
+  std::vector<double> frame_ms;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream iss{line};
+    unsigned frame;
+    double time, vtx_ms, raster_ms;
+    if (!(iss >> frame >> time >> vtx_ms >> raster_ms))
+      throw Error{"malformed baseline '" + path + '\''};
+    frame_ms.push_back(vtx_ms + raster_ms);
+  }
+  if (frame_ms.empty())
+    throw Error{"empty baseline '" + path + '\''};
+  return frame_ms;
+}
+
 } // namespace
 
-App::App(unsigned w, unsigned h, const std::string &name)
-    : fb_{w, h}, width_{w}, height_{h}, fps_counter_{0.25} {
+Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (auto i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    auto value = [&] {
+      if (i + 1 == argc)
+        throw Error{std::format("missing value for '{}'", arg)};
+      return std::string{argv[++i]};
+    };
+    try {
+      if (arg == "--frames")
+        options.frames = std::stoul(value());
+      else if (arg == "--step")
+        options.step = std::stod(value());
+      else if (arg == "--golden")
+        options.golden_dir = value();
+      else if (arg == "--tolerance")
+        options.tolerance = std::stoul(value());
+      else if (arg == "--baseline")
+        options.baseline = value();
+      else if (arg == "--threshold")
+        options.threshold = std::stod(value());
+      else if (arg == "--trace")
+        options.trace_dir = value();
+      else if (arg == "--update")
+        options.update = true;
+      else
+        throw Error{std::format("unknown option '{}'", arg)};
+    } catch (const std::logic_error &) {
+      throw Error{std::format("invalid value '{}' for '{}'", argv[i], arg)};
+    }
+  }
+  return options;
+}
+
+App::App(unsigned w, unsigned h, const std::string &name, const Options &options)
+    : fb_{w, h}, width_{w}, height_{h}, name_{name}, options_{options}, fps_counter_{0.25} {
+  ctx_.setFrameBuffer(&fb_);
+  if (options_.frames)
+    return;
+
   if (!SDL_Init(SDL_INIT_VIDEO))
     throw Error{std::format("failed to initialize SDL: {}", SDL_GetError())};
 
@@ -44,11 +213,12 @@ App::App(unsigned w, unsigned h, const std::string &name)
   if (!texture_)
     throw Error{std::format("failed to create SDL texture: {}", SDL_GetError())};
   SDL_SetTextureScaleMode(texture_, SDL_SCALEMODE_NEAREST);
-
-  ctx_.setFrameBuffer(&fb_);
+  present_fb_.emplace(w, h);
 }
 
 App::~App() {
+  if (options_.frames)
+    return;
   SDL_DestroyTexture(texture_);
   SDL_DestroyRenderer(renderer_);
   SDL_DestroyWindow(window_);
@@ -56,7 +226,31 @@ App::~App() {
 }
 
 void App::render() {
+  if (options_.frames) {
+    replay();
+    return;
+  }
+
+  // Frame N + 1 renders into fb_ on the render thread while this one presents
+  // frame N from present_fb_; SDL is only called from here. The two take
+  // turns: the render thread reads keys, time and delta, and this one swaps
+  // the framebuffers, only while the other waits.
+  using Clock = std::chrono::steady_clock;
   startup();
+  std::vector<SDL_Keycode> keys;
+  double time{};
+  double delta{};
+  Clock::time_point render_begin, render_end;
+  FrameThread render_thread{[&] {
+    render_begin = Clock::now();
+    for (auto key : keys)
+      onKeyDown(key);
+    renderLoop(time, delta);
+    drawHud();
+    ctx_.resetStats();
+    render_end = Clock::now();
+  }};
+  bool presenting = false;
   bool running = true;
   while (running) {
     SDL_Event event;
@@ -64,31 +258,152 @@ void App::render() {
       if (event.type == SDL_EVENT_QUIT ||
           (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_ESCAPE))
         running = false;
+      else if (event.type == SDL_EVENT_KEY_DOWN)
+        keys.push_back(event.key.key);
     }
-
-    auto time = SDL_GetTicksNS() / 1e9;
-    auto delta = time - last_time_;
+    time = SDL_GetTicksNS() / 1e9;
+    delta = time - last_time_;
     last_time_ = time;
-
     fps_counter_.tick(delta);
-    renderLoop(time, delta);
+
+    render_thread.start();
+    auto present_begin = Clock::now();
+    if (presenting)
+      present();
+    auto present_end = Clock::now();
+    render_thread.wait();
+    keys.clear();
+    std::swap(fb_, *present_fb_);
+    presenting = true;
+
+    auto ms = [](Clock::duration d) {
+      return std::chrono::duration<double, std::milli>(d).count();
+    };
+    auto overlap = std::min(render_end, present_end) - std::max(render_begin, present_begin);
+    render_ms_ = ms(render_end - render_begin);
+    present_ms_ = ms(present_end - present_begin);
+    overlap_ms_ = std::max(ms(overlap), 0.0);
+  }
+  shutdown();
+}
+
+void App::drawHud() {
+  auto &stats = ctx_.getStats();
+  drawText(fb_, 8, 8, 2,
+           std::format("{:.0f} fps  {:.1f} ms  vtx {:.1f}  ras {:.1f}", fps_counter_.fps(),
+                       fps_counter_.frameMs(), stats.vtx_ms, stats.raster_ms));
+  drawText(fb_, 8, 28, 2,
+           std::format("tris {}/{}  frag {:.2f}M  vcache {:.0f}%  draws culled {} reused {}",
+                       stats.drawn, stats.submitted, static_cast<double>(stats.fragments) / 1e6,
+                       stats.cacheHitRate() * 100.0, stats.draws_culled, stats.draws_reused));
+  drawText(fb_, 8, 48, 2,
+           std::format("rej {}  clip {}  cull {}  degen {}  z {:.0f}%  attr {:.1f}MB",
+                       stats.rejected, stats.clipped, stats.culled, stats.degenerate,
+                       stats.depth_tests ? stats.depth_passed * 100.0 / stats.depth_tests : 0.0,
+                       static_cast<double>(stats.attr_bytes) / 1e6));
+  // Of the previous frame, whose present may not be over yet.
+  drawText(fb_, 8, 68, 2,
+           std::format("render {:.1f} ms  present {:.1f} ms  overlap {:.1f} ms", render_ms_,
+                       present_ms_, overlap_ms_));
+}
+
+void App::present() {
+  // The color buffer is stored in blocks; detile it straight into the texture.
+  void *pixels;
+  int pitch;
+  if (!SDL_LockTexture(texture_, nullptr, &pixels, &pitch))
+    throw Error{std::format("failed to lock SDL texture: {}", SDL_GetError())};
+  present_fb_->getColorTexture().detile(pixels, pitch);
+  SDL_UnlockTexture(texture_);
+  // Framebuffer row 0 is the bottom scanline (GL convention); SDL draws row 0 at the top.
+  SDL_RenderTextureRotated(renderer_, texture_, nullptr, nullptr, 0.0, nullptr,
+                           SDL_FLIP_VERTICAL);
+  SDL_RenderPresent(renderer_);
+}
+
+void App::replay() {
+  auto file_name = name_;
+  std::ranges::replace(file_name, ' ', '_');
+  std::ostringstream timings;
+  timings << "# frame time_s vtx_ms raster_ms submitted drawn fragments rejected clipped culled "
+             "degenerate depth_tests depth_passed attr_bytes draws_culled draws_reused\n";
+  std::vector<double> frame_ms;
+  std::string failure;
+  auto differing_frames = 0u;
+  Image image{.width = width_, .height = height_, .pixels = {}};
+  image.pixels.resize(static_cast<size_t>(width_) * height_);
+
+  if (!options_.trace_dir.empty())
+    ctx_.setTrace(&trace_);
+
+  startup();
+  for (auto frame = 0u; frame < options_.frames; ++frame) {
+    auto time = frame * options_.step;
+    trace_.clear();
+    renderLoop(time, options_.step);
 
     auto &stats = ctx_.getStats();
-    drawText(fb_, 8, 8, 2,
-             std::format("{:.0f} fps  {:.1f} ms  vtx {:.1f}  ras {:.1f}", fps_counter_.fps(),
-                         fps_counter_.frameMs(), stats.vtx_ms, stats.raster_ms));
-    drawText(fb_, 8, 28, 2,
-             std::format("tris {}/{}  frag {:.2f}M", stats.drawn, stats.submitted,
-                         static_cast<double>(stats.fragments) / 1e6));
+    frame_ms.push_back(stats.vtx_ms + stats.raster_ms);
+    timings << std::format("{} {:.4f} {:.3f} {:.3f} {} {} {} {} {} {} {} {} {} {} {} {}\n",
+                           frame, time, stats.vtx_ms, stats.raster_ms, stats.submitted,
+                           stats.drawn, stats.fragments, stats.rejected, stats.clipped,
+                           stats.culled, stats.degenerate, stats.depth_tests, stats.depth_passed,
+                           stats.attr_bytes, stats.draws_culled, stats.draws_reused);
+    fb_.getColorTexture().detile(image.pixels.data(), width_ * sizeof(renderer::UNorm));
+    std::cout << std::format("{} {:.3f} s: {:016x}  vtx {:.2f} ms  ras {:.2f} ms\n", file_name,
+                             time, hashImage(image), stats.vtx_ms, stats.raster_ms);
     ctx_.resetStats();
 
-    SDL_UpdateTexture(texture_, nullptr, fb_.getColorTexture().getRawBuffer(), width_ * 4);
-    // Framebuffer row 0 is the bottom scanline (GL convention); SDL draws row 0 at the top.
-    SDL_RenderTextureRotated(renderer_, texture_, nullptr, nullptr, 0.0, nullptr,
-                             SDL_FLIP_VERTICAL);
-    SDL_RenderPresent(renderer_);
+    if (!options_.trace_dir.empty()) {
+      auto path = std::format("{}/{}_{:03}.json", options_.trace_dir, file_name, frame);
+      std::ofstream ofs(path);
+      trace_.write(ofs);
+      if (!ofs.good())
+        throw Error{"failed to write trace '" + path + '\''};
+    }
+
+    if (options_.golden_dir.empty())
+      continue;
+    auto path = std::format("{}/{}_{:03}.ppm", options_.golden_dir, file_name, frame);
+    if (options_.update) {
+      savePPM(path, image);
+      continue;
+    }
+    if (auto count = countDifferingPixels(loadPPM(path), image, options_.tolerance)) {
+      auto actual = std::format("{}/{}_{:03}.actual.ppm", options_.golden_dir, file_name, frame);
+      savePPM(actual, image);
+      std::cerr << std::format("{}: {} pixels differ, see {}\n", path, count, actual);
+      ++differing_frames;
+    }
   }
   shutdown();
+
+  if (differing_frames)
+    failure += std::format("{} of {} frames differ from the golden images\n", differing_frames,
+                           options_.frames);
+
+  if (!options_.baseline.empty()) {
+    if (options_.update || !std::ifstream{options_.baseline}.good()) {
+      std::ofstream ofs(options_.baseline);
+      if (!(ofs << timings.str()))
+        throw Error{"failed to write baseline '" + options_.baseline + '\''};
+    } else {
+      // The median is less sensitive than the mean to the odd slow frame.
+      auto baseline_ms = median(loadBaseline(options_.baseline));
+      auto current_ms = median(frame_ms);
+      auto change = (current_ms / baseline_ms - 1.) * 100.;
+      std::cout << std::format("median frame {:.2f} ms, baseline {:.2f} ms ({:+.1f}%)\n",
+                               current_ms, baseline_ms, change);
+      if (change > options_.threshold)
+        failure += std::format("frame time regressed by {:.1f}%, more than {:.1f}%\n", change,
+                               options_.threshold);
+    }
+  }
+
+  if (!failure.empty()) {
+    failure.pop_back();
+    throw Error{failure};
+  }
 }
 
 } // namespace app
@@ -2,6 +2,7 @@
 
 #include <SDL3/SDL.h>
 #include <iostream>
+#include <optional>
 #include <string>
 
 #include "app/error.h"
@@ -9,9 +10,9 @@
 #include "renderer/pipeline.h"
 
 #define DEFINE_AND_CALL_APP(app_type, w, h, title)                                                 \
-  int main() {                                                                                     \
+  int main(int argc, char **argv) {                                                                \
     try {                                                                                          \
-      app_type _app(w, h, #title);                                                                 \
+      app_type _app(w, h, #title, app::parseOptions(argc, argv));                                  \
       _app.render();                                                                               \
     } catch (const std::exception &e) {                                                            \
       std::cerr << e.what() << '\n';                                                               \
@@ -21,9 +22,29 @@
 
 namespace app {
 
+// Command line options. With --frames the app replays that many frames
+// offscreen, at fixed timestamps, instead of opening a window.
+struct Options {
+  unsigned frames{};      // --frames N
+  double step{1. / 30.};  // --step SECONDS between the frames.
+  std::string golden_dir; // --golden DIR: compare the frames with DIR/<name>_<frame>.ppm.
+  unsigned tolerance{};   // --tolerance N: allowed difference per color channel.
+  std::string baseline;   // --baseline FILE: per-frame timings to compare with.
+  double threshold{10.};  // --threshold PERCENT: allowed median frame time regression.
+  std::string trace_dir;  // --trace DIR: write DIR/<name>_<frame>.json Chrome traces.
+  bool update{};          // --update: write the golden images and baseline instead.
+};
+
+Options parseOptions(int argc, char **argv);
+
 class App {
 public:
-  App(unsigned w, unsigned h, const std::string &name);
+  App(unsigned w, unsigned h, const std::string &name, const Options &options = {});
+  // Runs interactively, or replays offscreen when frames are requested; a
+  // replay throws once done if a frame or the timings fail the comparison.
+  // Interactively, onKeyDown() and renderLoop() run on one render thread, kept
+  // for the whole run, while the previous frame is presented; startup() and
+  // shutdown() do not.
   void render();
   ~App();
 
@@ -31,17 +52,29 @@ protected:
   virtual void renderLoop(double time, double delta) = 0;
   virtual void startup() {}
   virtual void shutdown() {}
+  virtual void onKeyDown(SDL_Keycode) {}
 
   renderer::Pipeline ctx_;
   renderer::FrameBuffer fb_;
   unsigned width_, height_;
 
 private:
+  void replay();
+  void drawHud();
+  void present();
+
+  std::string name_;
+  Options options_;
   SDL_Window *window_{};
   SDL_Renderer *renderer_{};
   SDL_Texture *texture_{};
+  std::optional<renderer::FrameBuffer> present_fb_; // Swapped with fb_ after each frame.
   double last_time_{};
+  double render_ms_{};  // Time the previous frame took to render,
+  double present_ms_{}; // and the one before it to present,
+  double overlap_ms_{}; // both at once.
   FPSCounter fps_counter_;
+  renderer::Trace trace_;
 };
 
 } // namespace app
@@ -0,0 +1,90 @@
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "app/error.h"
+#include "app/mapped_file.h"
+
+namespace app {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path) {
+  file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                      FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    file_ = nullptr;
+    throw Error{"failed to open '" + path + '\''};
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_, &size)) {
+    close();
+    throw Error{"failed to get the size of '" + path + '\''};
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+  if (!size_)
+    return;
+
+  mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping_)
+    data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (!data_) {
+    close();
+    throw Error{"failed to map '" + path + '\''};
+  }
+}
+
+void MappedFile::close() {
+  if (data_)
+    UnmapViewOfFile(data_);
+  if (mapping_)
+    CloseHandle(mapping_);
+  if (file_)
+    CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path) {
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw Error{"failed to open '" + path + '\''};
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    ::close(fd);
+    throw Error{"failed to get the size of '" + path + '\''};
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (!size_) {
+    ::close(fd);
+    return;
+  }
+
+  // The mapping keeps the file referenced once the descriptor is closed.
+  auto data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    throw Error{"failed to map '" + path + '\''};
+  madvise(data, size_, MADV_WILLNEED);
+  data_ = static_cast<const char *>(data);
+}
+
+void MappedFile::close() {
+  if (data_)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+#endif
+
+MappedFile::~MappedFile() { close(); }
+
+} // namespace app
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace app {
+
+// Read-only view of a whole file, mapped into memory.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  [[nodiscard]] std::string_view getData() const { return {data_, size_}; }
+
+private:
+  void close();
+
+  const char *data_{};
+  size_t size_{};
+#ifdef _WIN32
+  void *file_{};
+  void *mapping_{};
+#endif
+};
+
+} // namespace app
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "app/error.h"
+#include "app/mesh_file.h"
+
+using namespace renderer;
+
+namespace app {
+
+static_assert(sizeof(MeshHeader) == 80, "MeshHeader must not have padding");
+static_assert(std::is_trivially_copyable_v<ObjVertex>);
+
+namespace {
+
+size_t alignUp(size_t offset) {
+  return (offset + mesh_alignment - 1) / mesh_alignment * mesh_alignment;
+}
+
+void writePadding(std::ofstream &ofs, size_t offset) {
+  constexpr char zeros[mesh_alignment]{};
+  ofs.write(zeros, static_cast<std::streamsize>(alignUp(offset) - offset));
+}
+
+} // namespace
+
+void saveMesh(const std::string &path, std::span<const ObjVertex> vertices,
+              std::span<const unsigned> indices) {
+  MeshHeader header{};
+  std::copy_n(MeshHeader::magic_value, 4, header.magic);
+  header.version = MeshHeader::current_version;
+  header.vertex_stride = sizeof(ObjVertex);
+  header.vertex_count = vertices.size();
+  header.vertex_offset = alignUp(sizeof(MeshHeader));
+  auto vertex_end = header.vertex_offset + vertices.size_bytes();
+  if (!indices.empty()) {
+    header.index_size = vertices.size() <= std::numeric_limits<uint16_t>::max() + 1uz ? 2 : 4;
+    header.index_count = indices.size();
+    header.index_offset = alignUp(vertex_end);
+  }
+  if (!vertices.empty()) {
+    header.flags |= MeshHeader::has_bounds;
+    auto bounds = computeBounds(vertices);
+    std::copy_n(&bounds.min[0], 3, header.bounds_min);
+    std::copy_n(&bounds.max[0], 3, header.bounds_max);
+  }
+
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs.good())
+    throw Error{"failed to create mesh '" + path + '\''};
+
+  ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  writePadding(ofs, sizeof(header));
+  ofs.write(reinterpret_cast<const char *>(vertices.data()),
+            static_cast<std::streamsize>(vertices.size_bytes()));
+  if (header.index_size == 4) {
+    writePadding(ofs, vertex_end);
+    ofs.write(reinterpret_cast<const char *>(indices.data()),
+              static_cast<std::streamsize>(indices.size_bytes()));
+  } else if (header.index_size == 2) {
+    writePadding(ofs, vertex_end);
+    std::vector<uint16_t> narrow(indices.begin(), indices.end());
+    ofs.write(reinterpret_cast<const char *>(narrow.data()),
+              static_cast<std::streamsize>(narrow.size() * sizeof(uint16_t)));
+  }
+  if (!ofs.good())
+    throw Error{"failed to write mesh '" + path + '\''};
+}
+
+MeshFile::MeshFile(const std::string &path) : file_{path} {
+  auto data = file_.getData();
+  if (data.size() < sizeof(header_))
+    throw Error{"truncated mesh '" + path + '\''};
+  std::memcpy(&header_, data.data(), sizeof(header_));
+  if (!std::equal(header_.magic, header_.magic + 4, MeshHeader::magic_value))
+    throw Error{"not a mesh file '" + path + '\''};
+  // Vertices are used as stored, so a file written by a build with another
+  // ObjVertex layout has to be converted again.
+  if (header_.version != MeshHeader::current_version || header_.vertex_stride != sizeof(ObjVertex))
+    throw Error{"unsupported mesh version or vertex layout '" + path + '\''};
+
+  auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+    return offset % mesh_alignment == 0 && offset <= data.size() &&
+           count <= (data.size() - offset) / size;
+  };
+  if (!fits(header_.vertex_offset, header_.vertex_count, sizeof(ObjVertex)) ||
+      (header_.index_size != 0 && header_.index_size != 2 && header_.index_size != 4) ||
+      (header_.index_size && !fits(header_.index_offset, header_.index_count, header_.index_size)))
+    throw Error{"corrupt mesh '" + path + '\''};
+
+  if (header_.flags & MeshHeader::has_bounds) {
+    bounds_ = {.min = {header_.bounds_min[0], header_.bounds_min[1], header_.bounds_min[2]},
+               .max = {header_.bounds_max[0], header_.bounds_max[1], header_.bounds_max[2]}};
+  }
+  vb_ = {.ptr = data.data() + header_.vertex_offset,
+         .count = header_.vertex_count,
+         .stride = sizeof(ObjVertex),
+         .bounds = header_.flags & MeshHeader::has_bounds ? &bounds_ : nullptr};
+  if (header_.index_size && header_.index_count) {
+    ib_ = {.ptr = data.data() + header_.index_offset,
+           .count = header_.index_count,
+           .type = header_.index_size == 2 ? IndexBuffer::Type::U16 : IndexBuffer::Type::U32};
+  }
+}
+
+} // namespace app
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "app/mapped_file.h"
+#include "app/obj_parser.h"
+
+namespace app {
+
+// Layout of a binary mesh file, in native byte order: the header, then
+// vertex_count ObjVertex at vertex_offset, then index_count indices of
+// index_size bytes at index_offset, if any. Offsets are multiples of
+// mesh_alignment from the start of the file.
+struct MeshHeader {
+  constexpr static char magic_value[4]{'S', 'R', 'M', 'F'};
+  constexpr static uint32_t current_version{1};
+  constexpr static uint32_t has_bounds{1}; // Flag.
+
+  char magic[4];
+  uint32_t version;
+  uint32_t vertex_stride; // sizeof(ObjVertex) of the writer.
+  uint32_t index_size;    // 2 or 4; 0 if not indexed.
+  uint64_t vertex_count;
+  uint64_t vertex_offset;
+  uint64_t index_count;
+  uint64_t index_offset;
+  uint32_t flags;
+  float bounds_min[3]; // Of the vertex positions, if has_bounds is set.
+  float bounds_max[3];
+  uint32_t reserved;
+};
+
+constexpr size_t mesh_alignment{64};
+
+// Writes vertices, and indices unless empty, with the bounds of the positions.
+// Indices are stored in 16 bits when every vertex can be addressed so.
+void saveMesh(const std::string &path, std::span<const ObjVertex> vertices,
+              std::span<const unsigned> indices = {});
+
+// Mesh file mapped into memory. The buffers point straight into the mapping, so
+// that nothing is read before the pipeline touches it; they stay valid as long
+// as the MeshFile. The header and sizes are checked, the index values are not.
+class MeshFile {
+public:
+  explicit MeshFile(const std::string &path);
+
+  [[nodiscard]] const renderer::VertexBuffer &getVertexBuffer() const { return vb_; }
+  // nullptr if not indexed.
+  [[nodiscard]] const renderer::IndexBuffer *getIndexBuffer() const {
+    return ib_.count ? &ib_ : nullptr;
+  }
+  [[nodiscard]] const MeshHeader &getHeader() const { return header_; }
+
+private:
+  MappedFile file_;
+  MeshHeader header_;
+  renderer::Aabb bounds_;
+  renderer::VertexBuffer vb_{};
+  renderer::IndexBuffer ib_{};
+};
+
+} // namespace app
@@ -1,8 +1,16 @@
-#include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 
+#include "app/error.h"
+#include "app/mapped_file.h"
 #include "app/obj_parser.h"
+#include "renderer/thread_pool.h"
 
 using namespace renderer;
 
@@ -10,63 +18,280 @@ namespace app {
 
 namespace {
 
-auto consumeFaceElement(std::istringstream &iss) {
-  unsigned vertex{}, uv{}, normal{};
-  iss >> vertex;
-  if (iss.peek() == '/') {
-    iss.get();
-    if (iss.peek() != '/')
-      iss >> uv;
+// Files are split into chunks of at least this many bytes, parsed in parallel.
+constexpr auto min_chunk_size = 1uz << 20;
+
+// Indices as written in the file: 1-based, negative ones count back from the
+// last element of their kind defined so far, 0 means absent.
+struct FaceElement {
+  int vertex, uv, normal;
+};
+
+struct Polygon {
+  unsigned first, count; // Into Chunk::elements.
+  // Elements of each kind defined before the polygon, within its chunk.
+  unsigned vertices, uvs, normals;
+};
+
+// A run of whole lines, parsed on its own. The bases are the number of
+// elements of each kind, and of triangles, in the chunks before it.
+struct Chunk {
+  std::string_view text;
+  std::vector<Vec3> vertices;
+  std::vector<Vec3> normals;
+  std::vector<Vec2> uvs;
+  std::vector<FaceElement> elements;
+  std::vector<Polygon> polygons;
+  Aabb bounds;
+  size_t vertex_base, uv_base, normal_base, triangle_base;
+};
+
+bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+const char *skipBlanks(const char *p, const char *end) {
+  while (p != end && isBlank(*p))
+    ++p;
+  return p;
+}
+
+// Components missing or malformed are left as they are.
+template <class T> const char *parseNumber(const char *p, const char *end, T &out) {
+  p = skipBlanks(p, end);
+  if (p != end && *p == '+')
+    ++p;
+  return std::from_chars(p, end, out).ptr;
+}
+
+template <unsigned N> const char *parseFloats(const char *p, const char *end, float (&out)[N]) {
+  for (auto &value : out)
+    p = parseNumber(p, end, value);
+  return p;
+}
+
+// Parses a v, v/vt, v//vn or v/vt/vn face element.
+const char *parseFaceElement(const char *p, const char *end, FaceElement &out) {
+  out = {};
+  p = parseNumber(p, end, out.vertex);
+  if (p != end && *p == '/') {
+    ++p;
+    if (p != end && *p != '/')
+      p = std::from_chars(p, end, out.uv).ptr;
   }
-  if (iss.peek() == '/') {
-    iss.get();
-    iss >> normal;
+  if (p != end && *p == '/')
+    p = std::from_chars(p + 1, end, out.normal).ptr;
+  return p;
+}
+
+void parseLine(const char *p, const char *end, Chunk &chunk) {
+  p = skipBlanks(p, end);
+  auto is = [&](std::string_view type) {
+    return static_cast<size_t>(end - p) > type.size() && std::equal(type.begin(), type.end(), p) &&
+           isBlank(p[type.size()]);
+  };
+
+  if (is("v")) {
+    float pos[3]{};
+    parseFloats(p + 2, end, pos);
+    chunk.vertices.emplace_back(pos[0], pos[1], pos[2]);
+    chunk.bounds.extend(chunk.vertices.back());
+  } else if (is("vt")) {
+    float uv[2]{};
+    parseFloats(p + 3, end, uv);
+    chunk.uvs.emplace_back(uv[0], uv[1]);
+  } else if (is("vn")) {
+    float normal[3]{};
+    parseFloats(p + 3, end, normal);
+    chunk.normals.emplace_back(normal[0], normal[1], normal[2]);
+  } else if (is("f")) {
+    Polygon polygon{.first = static_cast<unsigned>(chunk.elements.size()),
+                    .count = 0,
+                    .vertices = static_cast<unsigned>(chunk.vertices.size()),
+                    .uvs = static_cast<unsigned>(chunk.uvs.size()),
+                    .normals = static_cast<unsigned>(chunk.normals.size())};
+    p += 2;
+    for (;;) {
+      p = skipBlanks(p, end);
+      if (p == end || *p == '\r' || *p == '#')
+        break;
+      FaceElement element;
+      auto next = parseFaceElement(p, end, element);
+      if (next == p || !element.vertex)
+        break;
+      chunk.elements.push_back(element);
+      p = next;
+    }
+    polygon.count = chunk.elements.size() - polygon.first;
+    if (polygon.count >= 3)
+      chunk.polygons.push_back(polygon);
+    else
+      chunk.elements.resize(polygon.first);
   }
-  return std::make_tuple(vertex, uv, normal);
 }
 
-} // namespace
+void parseChunk(Chunk &chunk) {
+  auto p = chunk.text.data();
+  auto end = p + chunk.text.size();
+  while (p != end) {
+    auto eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (!eol)
+      eol = end;
+    parseLine(p, eol, chunk);
+    p = eol == end ? end : eol + 1;
+  }
+}
 
-std::vector<ObjVertex> parseObj(const std::string &path) {
-  std::vector<ObjVertex> out;
-  std::ifstream fs(path);
-  if (!fs.good())
-    return out;
+// Splits text at line ends into chunks and parses them in parallel.
+std::vector<Chunk> parseChunks(std::string_view text) {
+  auto count = std::clamp<size_t>(text.size() / min_chunk_size, 1,
+                                  std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<Chunk> chunks;
+  for (auto begin = 0uz; begin < text.size();) {
+    auto end = std::min(text.size(), begin + text.size() / count);
+    end = chunks.size() + 1 == count ? text.size() : text.find('\n', end);
+    end = end == std::string_view::npos ? text.size() : end + 1;
+    chunks.emplace_back().text = text.substr(begin, end - begin);
+    begin = end;
+  }
 
+  if (chunks.size() > 1) {
+    ThreadPool pool{static_cast<unsigned>(chunks.size())};
+    pool.run(chunks.size(), [&](size_t i, unsigned) { parseChunk(chunks[i]); });
+  } else if (!chunks.empty()) {
+    parseChunk(chunks[0]);
+  }
+  return chunks;
+}
+
+// The parsed file, with the elements of every chunk joined. The bases of a
+// chunk are prefix sums over the chunks before it.
+struct ObjFile {
+  MappedFile file;
+  std::vector<Chunk> chunks;
   std::vector<Vec3> vertices;
   std::vector<Vec3> normals;
   std::vector<Vec2> uvs;
+  Aabb bounds;
+  size_t triangles{};
 
-  std::string line, type;
-  while (std::getline(fs, line)) {
-    if (line.empty())
-      continue;
-
-    std::istringstream iss(line);
-    iss >> type;
-
-    if (type == "v") {
-      float x, y, z;
-      iss >> x >> y >> z;
-      vertices.emplace_back(x, y, z);
-    } else if (type == "vt") {
-      float u, v;
-      iss >> u >> v;
-      uvs.emplace_back(u, v);
-    } else if (type == "vn") {
-      float x, y, z;
-      iss >> x >> y >> z;
-      normals.emplace_back(x, y, z);
-    } else if (type == "f") {
-      for (auto i = 0u; i < 3; ++i) {
-        auto [vertex_id, uv_id, normal_id] = consumeFaceElement(iss);
-        out.emplace_back(vertices[vertex_id - 1], normal_id ? normals[normal_id - 1] : Vec3{},
-                         uv_id ? uvs[uv_id - 1] : Vec2{});
+  explicit ObjFile(const std::string &path) : file{path}, chunks{parseChunks(file.getData())} {
+    for (auto &chunk : chunks) {
+      if (!chunk.vertices.empty()) {
+        bounds.extend(chunk.bounds.min);
+        bounds.extend(chunk.bounds.max);
       }
+      chunk.vertex_base = vertices.size();
+      chunk.uv_base = uvs.size();
+      chunk.normal_base = normals.size();
+      chunk.triangle_base = triangles;
+      vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+      normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+      uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+      for (auto &polygon : chunk.polygons)
+        triangles += polygon.count - 2;
+    }
+  }
+};
+
+// Turns an index as written into a 1-based one into all elements of its kind,
+// 0 if absent; before is how many of them precede it. Returns -1 if out of
+// range.
+int64_t resolve(int index, size_t before, size_t total) {
+  auto resolved = index < 0 ? static_cast<int64_t>(before) + index + 1 : int64_t{index};
+  return resolved < 0 || static_cast<size_t>(resolved) > total ? -1 : resolved;
+}
+
+// Calls emit(vertex_id, uv_id, normal_id), ids as returned by resolve(), for
+// the three elements of every triangle the polygons of chunk are fanned out
+// into. Returns false on an out-of-range index.
+template <class F> bool forEachTriangle(const ObjFile &obj, const Chunk &chunk, F emit) {
+  for (auto &polygon : chunk.polygons) {
+    int64_t ids[3][3];
+    auto elements = &chunk.elements[polygon.first];
+    auto resolveElement = [&](const FaceElement &element, int64_t(&out)[3]) {
+      out[0] = resolve(element.vertex, chunk.vertex_base + polygon.vertices, obj.vertices.size());
+      out[1] = resolve(element.uv, chunk.uv_base + polygon.uvs, obj.uvs.size());
+      out[2] = resolve(element.normal, chunk.normal_base + polygon.normals, obj.normals.size());
+      return out[0] > 0 && out[1] >= 0 && out[2] >= 0;
+    };
+
+    if (!resolveElement(elements[0], ids[0]) || !resolveElement(elements[1], ids[2]))
+      return false;
+    for (auto i = 2u; i < polygon.count; ++i) {
+      std::copy_n(ids[2], 3, ids[1]);
+      if (!resolveElement(elements[i], ids[2]))
+        return false;
+      for (auto &id : ids)
+        emit(id[0], id[1], id[2]);
     }
   }
+  return true;
+}
+
+struct FaceElementHash {
+  size_t operator()(const std::tuple<int64_t, int64_t, int64_t> &key) const {
+    auto [vertex, uv, normal] = key;
+    return (static_cast<size_t>(vertex) * 0x9e3779b97f4a7c15ull) ^
+           (static_cast<size_t>(uv) * 0xc2b2ae3d27d4eb4full) ^ static_cast<size_t>(normal);
+  }
+};
+
+} // namespace
+
+std::vector<ObjVertex> parseObj(const std::string &path) {
+  ObjFile obj{path};
+  std::vector<ObjVertex> out(obj.triangles * 3);
+  std::atomic<bool> valid{true};
+  auto emitChunk = [&](size_t i, unsigned) {
+    auto slot = obj.chunks[i].triangle_base * 3;
+    auto emit = [&](auto vertex_id, auto uv_id, auto normal_id) {
+      out[slot++] = {obj.vertices[vertex_id - 1],
+                              normal_id ? obj.normals[normal_id - 1] : Vec3{},
+                              uv_id ? obj.uvs[uv_id - 1] : Vec2{}};
+    };
+    if (!forEachTriangle(obj, obj.chunks[i], emit))
+      valid = false;
+  };
+
+  if (obj.chunks.size() > 1) {
+    ThreadPool pool{static_cast<unsigned>(obj.chunks.size())};
+    pool.run(obj.chunks.size(), emitChunk);
+  } else if (!obj.chunks.empty()) {
+    emitChunk(0, 0);
+  }
+  if (!valid)
+    throw Error{"index out of range in OBJ '" + path + '\''};
+
+  return out;
+}
+
+ObjMesh parseObjIndexed(const std::string &path) {
+  ObjFile obj{path};
+  ObjMesh out{.vertices = {}, .indices = {}, .bounds = obj.bounds};
+  std::unordered_map<std::tuple<int64_t, int64_t, int64_t>, unsigned, FaceElementHash> ids;
+  out.indices.reserve(obj.triangles * 3);
+
+  auto emit = [&](auto vertex_id, auto uv_id, auto normal_id) {
+    auto [it, inserted] =
+        ids.try_emplace({vertex_id, uv_id, normal_id}, static_cast<unsigned>(out.vertices.size()));
+    if (inserted)
+      out.vertices.emplace_back(obj.vertices[vertex_id - 1],
+                                normal_id ? obj.normals[normal_id - 1] : Vec3{},
+                                uv_id ? obj.uvs[uv_id - 1] : Vec2{});
+    out.indices.push_back(it->second);
+  };
+  for (auto &chunk : obj.chunks) {
+    if (!forEachTriangle(obj, chunk, emit))
+      throw Error{"index out of range in OBJ '" + path + '\''};
+  }
 
   return out;
 }
 
+Aabb computeBounds(std::span<const ObjVertex> vertices) {
+  Aabb bounds;
+  for (auto &vertex : vertices)
+    bounds.extend(vertex.pos);
+  return bounds;
+}
+
 } // namespace app
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <span>
 #include <string>
 #include <vector>
 
@@ -8,6 +9,7 @@
 namespace app {
 
 struct ObjVertex : renderer::Vertex {
+  ObjVertex() = default;
   ObjVertex(const renderer::Vec3 &pos, const renderer::Vec3 &normal, const renderer::Vec2 &tc)
       : Vertex{pos}, normal{normal}, tc{tc} {}
 
@@ -15,6 +17,19 @@ struct ObjVertex : renderer::Vertex {
   renderer::Vec2 tc;
 };
 
+struct ObjMesh {
+  std::vector<ObjVertex> vertices;
+  std::vector<unsigned> indices;
+  renderer::Aabb bounds; // Of all positions in the file.
+};
+
+// Triangles of the faces of an OBJ file, three vertices each; polygons are
+// fanned out. Large files are parsed in parallel.
 std::vector<ObjVertex> parseObj(const std::string &path);
+// Like parseObj(), but face elements with the same position, normal and texture
+// coordinates share a vertex, referenced through the indices.
+ObjMesh parseObjIndexed(const std::string &path);
+// Bounds of the positions of vertices, e.g. for VertexBuffer::bounds.
+renderer::Aabb computeBounds(std::span<const ObjVertex> vertices);
 
 } // namespace app
@@ -0,0 +1,55 @@
+#include <fstream>
+
+#include "app/error.h"
+#include "app/ppm.h"
+
+namespace app {
+
+void savePPM(const std::string &path, const Image &image) {
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs.good())
+    throw Error{"failed to create PPM '" + path + '\''};
+
+  ofs << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+  std::vector<unsigned char> row(image.width * 3);
+  for (auto y = image.height; y-- > 0;) {
+    for (auto x = 0u; x < image.width; ++x) {
+      auto &pix = image.pixels[static_cast<size_t>(y) * image.width + x];
+      row[x * 3] = pix.r;
+      row[x * 3 + 1] = pix.g;
+      row[x * 3 + 2] = pix.b;
+    }
+    ofs.write(reinterpret_cast<const char *>(row.data()), static_cast<std::streamsize>(row.size()));
+  }
+  if (!ofs.good())
+    throw Error{"failed to write PPM '" + path + '\''};
+}
+
+Image loadPPM(const std::string &path) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs.good())
+    throw Error{"failed to open PPM '" + path + '\''};
+
+  std::string magic;
+  unsigned max_value{};
+  Image image;
+  ifs >> magic >> image.width >> image.height >> max_value;
+  ifs.get();
+  if (!ifs.good() || magic != "P6" || max_value != 255)
+    throw Error{"unsupported PPM '" + path + '\''};
+
+  image.pixels.resize(static_cast<size_t>(image.width) * image.height);
+  std::vector<unsigned char> row(image.width * 3);
+  for (auto y = image.height; y-- > 0;) {
+    ifs.read(reinterpret_cast<char *>(row.data()), static_cast<std::streamsize>(row.size()));
+    for (auto x = 0u; x < image.width; ++x)
+      image.pixels[static_cast<size_t>(y) * image.width + x] = {row[x * 3], row[x * 3 + 1],
+                                                               row[x * 3 + 2], 255};
+  }
+  if (!ifs.good())
+    throw Error{"truncated PPM '" + path + '\''};
+
+  return image;
+}
+
+} // namespace app
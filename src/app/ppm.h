@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "renderer/texture.h"
+
+namespace app {
+
+struct Image {
+  unsigned width{}, height{};
+  std::vector<renderer::UNorm> pixels; // Row 0 is the bottom scanline.
+};
+
+// Binary (P6) PPM files, stored top row first. Alpha is not stored; loaded
+// pixels are opaque.
+void savePPM(const std::string &path, const Image &image);
+Image loadPPM(const std::string &path);
+
+} // namespace app
@@ -1,53 +1,151 @@
-#include <fstream>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
-#include "app/error.h"
 #include "app/tga_loader.h"
 
+using namespace renderer;
+
 namespace {
 
 #pragma pack(push, 1)
 struct TGAHeader {
-  char id_len;
-  char colormap_type;
-  char datatype_code;
-  short int colormap_orig;
-  short int colormap_len;
-  char colormap_depth;
-  short int x_origin;
-  short int y_origin;
-  short width;
-  short height;
-  char bpp;
-  char img_desc;
+  uint8_t id_len;
+  uint8_t colormap_type;
+  uint8_t datatype_code;
+  uint16_t colormap_orig;
+  uint16_t colormap_len;
+  uint8_t colormap_depth;
+  uint16_t x_origin;
+  uint16_t y_origin;
+  uint16_t width;
+  uint16_t height;
+  uint8_t bpp;
+  uint8_t img_desc;
 };
 #pragma pack(pop)
 
-struct Pixel24 {
-  unsigned char b;
-  unsigned char g;
-  unsigned char r;
-};
+constexpr uint8_t true_color{2};
+constexpr uint8_t true_color_rle{10};
+constexpr uint8_t right_origin_bit{0x10};
+constexpr uint8_t top_origin_bit{0x20};
+
+// Converts count BGR or BGRA pixels of size bytes each to RGBA.
+void convertPixels(const unsigned char *src, size_t count, unsigned size, UNorm *dst) {
+  auto i = 0uz;
+#ifdef __AVX__
+  // Four pixels per SSSE3 shuffle. A load of four BGR pixels reads 16 bytes
+  // for 12, so that loop stops while two more pixels follow.
+  if (size == 3) {
+    auto shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    auto alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+    for (; i + 6 <= count; i += 4) {
+      auto bgr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                       _mm_or_si128(_mm_shuffle_epi8(bgr, shuffle), alpha));
+    }
+  } else {
+    auto shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    for (; i + 4 <= count; i += 4) {
+      auto bgra = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_shuffle_epi8(bgra, shuffle));
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    auto pix = src + i * size;
+    dst[i] = {pix[2], pix[1], pix[0], size == 4 ? pix[3] : static_cast<unsigned char>(255)};
+  }
+}
 
 } // namespace
 
 namespace app {
 
-std::vector<renderer::UNorm> loadTGA(const std::string &path) {
-  std::ifstream ifs(path, std::ios::binary);
-  if (!ifs.good())
-    throw Error{"failed to open TGA '" + path + '\''};
-
+TGAFile::TGAFile(const std::string &path) : path_{path}, file_{path} {
+  auto data = file_.getData();
   TGAHeader header;
-  ifs.read(reinterpret_cast<char *>(&header), sizeof header);
-  unsigned size = header.width * header.height;
-  std::vector<renderer::UNorm> out(size);
-
-  for (auto i = 0u; i < size; ++i) {
-    Pixel24 pix;
-    ifs.read(reinterpret_cast<char *>(&pix), sizeof pix);
-    out[i] = {pix.r, pix.g, pix.b, 255};
+  if (data.size() < sizeof header)
+    throw Error{"truncated TGA '" + path + '\''};
+  std::memcpy(&header, data.data(), sizeof header);
+
+  if ((header.datatype_code != true_color && header.datatype_code != true_color_rle) ||
+      (header.bpp != 24 && header.bpp != 32))
+    throw Error{"unsupported TGA '" + path + '\''};
+
+  pixels_offset_ = sizeof header + header.id_len;
+  if (header.colormap_type)
+    pixels_offset_ += header.colormap_len * ((header.colormap_depth + 7u) / 8);
+  width_ = header.width;
+  height_ = header.height;
+  pixel_size_ = header.bpp / 8;
+  rle_ = header.datatype_code == true_color_rle;
+  top_origin_ = header.img_desc & top_origin_bit;
+  right_origin_ = header.img_desc & right_origin_bit;
+
+  if (pixels_offset_ > data.size() ||
+      (!rle_ && (data.size() - pixels_offset_) / pixel_size_ / std::max(width_, 1u) < height_))
+    throw Error{"truncated TGA '" + path + '\''};
+}
+
+void TGAFile::decode(const RowSink &put) const {
+  auto data = file_.getData();
+  auto p = reinterpret_cast<const unsigned char *>(data.data()) + pixels_offset_;
+  auto end = reinterpret_cast<const unsigned char *>(data.data()) + data.size();
+  auto truncated = [&] { return Error{"truncated TGA '" + path_ + '\''}; };
+
+  std::vector<UNorm> row(width_);
+  // RLE packets may span rows.
+  auto run = 0u;
+  auto repeat = false;
+  UNorm repeated;
+  for (auto i = 0u; i < height_; ++i) {
+    if (!rle_) {
+      convertPixels(p, width_, pixel_size_, row.data());
+      p += static_cast<size_t>(width_) * pixel_size_;
+    } else {
+      for (auto x = 0u; x < width_;) {
+        if (!run) {
+          if (p == end)
+            throw truncated();
+          repeat = *p & 0x80;
+          run = (*p++ & 0x7fu) + 1;
+          if (repeat) {
+            if (static_cast<size_t>(end - p) < pixel_size_)
+              throw truncated();
+            convertPixels(p, 1, pixel_size_, &repeated);
+            p += pixel_size_;
+          }
+        }
+        auto count = std::min(run, width_ - x);
+        if (repeat) {
+          std::fill_n(&row[x], count, repeated);
+        } else {
+          if (static_cast<size_t>(end - p) < static_cast<size_t>(count) * pixel_size_)
+            throw truncated();
+          convertPixels(p, count, pixel_size_, &row[x]);
+          p += static_cast<size_t>(count) * pixel_size_;
+        }
+        x += count;
+        run -= count;
+      }
+    }
+    if (right_origin_)
+      std::reverse(row.begin(), row.end());
+    put(top_origin_ ? height_ - 1 - i : i, row.data());
   }
+}
 
+std::vector<UNorm> loadTGA(const std::string &path) {
+  TGAFile file{path};
+  auto width = file.getWidth();
+  std::vector<UNorm> out(static_cast<size_t>(width) * file.getHeight());
+  file.decode([&](unsigned y, const UNorm *texels) {
+    std::copy_n(texels, width, &out[static_cast<size_t>(y) * width]);
+  });
   return out;
 }
 
@@ -1,12 +1,60 @@
 #pragma once
 
+#include <algorithm>
+#include <functional>
 #include <string>
 #include <vector>
 
+#include "app/error.h"
+#include "app/mapped_file.h"
 #include "renderer/texture.h"
 
 namespace app {
 
+// Uncompressed or RLE true-color TGA file of 24 or 32 bits per pixel, mapped
+// into memory. 24-bit pixels are opaque.
+class TGAFile {
+public:
+  // Calls with the texels of row y, y = 0 being the bottom one.
+  using RowSink = std::function<void(unsigned y, const renderer::UNorm *texels)>;
+
+  explicit TGAFile(const std::string &path);
+
+  // Decodes the pixels row by row, whatever corner the file starts at.
+  void decode(const RowSink &put) const;
+
+  [[nodiscard]] unsigned getWidth() const { return width_; }
+  [[nodiscard]] unsigned getHeight() const { return height_; }
+
+private:
+  std::string path_;
+  MappedFile file_;
+  size_t pixels_offset_;
+  unsigned width_;
+  unsigned height_;
+  unsigned pixel_size_; // In bytes.
+  bool rle_;
+  bool top_origin_;
+  bool right_origin_;
+};
+
+// Texels row by row, bottom row first.
 std::vector<renderer::UNorm> loadTGA(const std::string &path);
 
+// Decodes straight into texture, which must have the size of the image, and
+// rebuilds its mips.
+template <class Layout>
+void loadTGA(const std::string &path, renderer::Texture<renderer::UNorm, Layout> &texture) {
+  TGAFile file{path};
+  auto width = file.getWidth();
+  if (width != texture.getWidth() || file.getHeight() != texture.getHeight())
+    throw Error{"TGA '" + path + "' does not match the size of the texture"};
+
+  file.decode([&](unsigned y, const renderer::UNorm *texels) {
+    for (auto x = 0u; x < width; x += Layout::span)
+      std::copy_n(texels + x, std::min(Layout::span, width - x), texture.getSpan(x, y));
+  });
+  texture.buildMips();
+}
+
 } // namespace app
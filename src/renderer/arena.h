@@ -1,15 +1,23 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <new>
 
 namespace renderer {
 
 class Arena {
 public:
   Arena() = default;
-  Arena(unsigned count, unsigned size, unsigned alignment) { reset(count, size, alignment); }
+  Arena(size_t count, size_t size, size_t alignment) { reset(count, size, alignment); }
 
-  void reset(unsigned count, unsigned size, unsigned alignment) {
+  // Throws std::bad_array_new_length, as new[] would, if count blocks of size
+  // bytes do not fit in memory.
+  void reset(size_t count, size_t size, size_t alignment) {
+    if (size && count > (std::numeric_limits<size_t>::max() - alignment) / size)
+      throw std::bad_array_new_length{};
     auto alloc_size = count * size + alignment - 1;
     if (size && alloc_size_ < alloc_size) {
       storage_ = std::make_unique<unsigned char[]>(alloc_size);
@@ -18,6 +26,7 @@ public:
     size_ = size;
     ptr_ = reinterpret_cast<void *>((reinterpret_cast<uintptr_t>(storage_.get()) + alignment - 1) &
                                     ~(static_cast<uintptr_t>(alignment) - 1));
+    base_ = ptr_;
   }
 
   template <class T> T *allocate() {
@@ -27,11 +36,18 @@ public:
     return static_cast<T *>(p);
   }
 
+  // The index-th block since the last reset(), regardless of allocate(). Lets
+  // several threads fill disjoint slices of the arena.
+  template <class T> T *at(size_t index) const {
+    return reinterpret_cast<T *>(static_cast<unsigned char *>(base_) + index * size_);
+  }
+
 private:
   std::unique_ptr<unsigned char[]> storage_;
   void *ptr_{nullptr};
-  unsigned size_{};
-  unsigned alloc_size_{};
+  void *base_{nullptr};
+  size_t size_{};
+  size_t alloc_size_{};
 };
 
 } // namespace renderer
@@ -0,0 +1,40 @@
+#include "renderer/command_list.h"
+
+namespace renderer {
+
+void CommandList::draw() {
+  commands_.emplace_back(DrawCmd{cache_.size()});
+  cache_.emplace_back();
+}
+
+void CommandList::clear() {
+  commands_.clear();
+  cache_.clear();
+}
+
+std::string CommandList::validate() const {
+  const VertexBuffer *vb = nullptr;
+  const Program *program = nullptr;
+  for (auto i = 0uz; i < commands_.size(); ++i) {
+    auto &command = commands_[i];
+    if (auto cmd = std::get_if<VertexBufferCmd>(&command))
+      vb = cmd->vb;
+    else if (auto cmd = std::get_if<ProgramCmd>(&command))
+      program = cmd->program;
+
+    auto draw = std::holds_alternative<DrawCmd>(command);
+    if (!draw && !std::holds_alternative<DrawInstancedCmd>(command))
+      continue;
+    if (!vb)
+      return "command " + std::to_string(i) + ": draw without a vertex buffer";
+    if (!program)
+      return "command " + std::to_string(i) + ": draw without a program";
+    if (draw && !program->vs)
+      return "command " + std::to_string(i) + ": draw with a program lacking vs";
+    if (!draw && !program->vs_instance)
+      return "command " + std::to_string(i) + ": drawInstanced with a program lacking vs_instance";
+  }
+  return {};
+}
+
+} // namespace renderer
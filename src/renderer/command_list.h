@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "renderer/pipeline.h"
+
+namespace renderer {
+
+// Whether equal values of T have equal bytes, i.e. T has no padding, as
+// std::has_unique_object_representations tells except that floats count:
+// only their zeros and NaNs have several representations, which at worst cost
+// a transform. Specialize it for uniform structs made of floats.
+template <class T>
+constexpr bool has_unique_bytes =
+    std::has_unique_object_representations_v<T> || std::is_floating_point_v<T>;
+template <class T, size_t N> constexpr bool has_unique_bytes<T[N]> = has_unique_bytes<T>;
+template <> constexpr bool has_unique_bytes<Vec2> = sizeof(Vec2) == 2 * sizeof(float);
+template <> constexpr bool has_unique_bytes<Vec3> = sizeof(Vec3) == 3 * sizeof(float);
+template <> constexpr bool has_unique_bytes<Vec4> = sizeof(Vec4) == 4 * sizeof(float);
+template <> constexpr bool has_unique_bytes<Mat4> = sizeof(Mat4) == 16 * sizeof(float);
+
+// Pipeline state changes and draws, recorded once and replayed every frame
+// with Pipeline::replay(). Buffers, programs and uniforms are referenced, not
+// copied, so they may change between replays.
+//
+// A list also keeps the post-transform triangles of each of its draws: a draw
+// whose uniform bytes, vertex and index buffers, program and framebuffer size
+// hash the same as in the previous replay skips transform() and only
+// rasterizes them again. Buffers are told apart by their pointers, sizes and
+// generation, not their contents. Instanced draws are always transformed.
+class CommandList {
+public:
+  void setVertexBuffer(const VertexBuffer *vb) { commands_.emplace_back(VertexBufferCmd{vb}); }
+  void setIndexBuffer(const IndexBuffer *ib) { commands_.emplace_back(IndexBufferCmd{ib}); }
+  void setProgram(const Program *program) { commands_.emplace_back(ProgramCmd{program}); }
+  // The size bytes at u are hashed to tell whether the uniform block changed,
+  // so they must not include padding.
+  void setUniform(const void *u, size_t size) { commands_.emplace_back(UniformCmd{u, size}); }
+  template <class T> void setUniform(const T *u) {
+    static_assert(std::is_trivially_copyable_v<T> && has_unique_bytes<T>,
+                  "uniforms are hashed as bytes, see has_unique_bytes");
+    setUniform(u, sizeof(T));
+  }
+  void setCulling(Pipeline::Culling mode) { commands_.emplace_back(CullingCmd{mode}); }
+  void setPass(Pipeline::Pass pass) { commands_.emplace_back(PassCmd{pass}); }
+  void setWireframeMode(bool mode) { commands_.emplace_back(WireframeCmd{mode}); }
+  void draw();
+  void drawInstanced(unsigned count, const void *instance_data, size_t instance_stride) {
+    commands_.emplace_back(DrawInstancedCmd{count, instance_data, instance_stride});
+  }
+  void clear();
+
+  // Describes the first draw lacking a vertex buffer or a program with the
+  // shader it needs; empty if there is none. Lists must not rely on state set
+  // on the pipeline before the replay.
+  [[nodiscard]] std::string validate() const;
+
+private:
+  friend class Pipeline;
+
+  struct VertexBufferCmd {
+    const VertexBuffer *vb;
+  };
+  struct IndexBufferCmd {
+    const IndexBuffer *ib;
+  };
+  struct ProgramCmd {
+    const Program *program;
+  };
+  struct UniformCmd {
+    const void *ptr;
+    size_t size;
+  };
+  struct CullingCmd {
+    Pipeline::Culling mode;
+  };
+  struct PassCmd {
+    Pipeline::Pass pass;
+  };
+  struct WireframeCmd {
+    bool mode;
+  };
+  struct DrawCmd {
+    size_t cache; // Into cache_.
+  };
+  struct DrawInstancedCmd {
+    unsigned count;
+    const void *data;
+    size_t stride;
+  };
+  using Command = std::variant<VertexBufferCmd, IndexBufferCmd, ProgramCmd, UniformCmd, CullingCmd,
+                               PassCmd, WireframeCmd, DrawCmd, DrawInstancedCmd>;
+
+  std::vector<Command> commands_;
+  std::vector<Pipeline::TransformCache> cache_;
+};
+
+} // namespace renderer
@@ -1,34 +1,294 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #include "renderer/texture.h"
 
 namespace renderer {
 
 class FrameBuffer {
 public:
-  FrameBuffer(unsigned width, unsigned height) : color_{width, height}, depth_{width, height} {}
+  // The farthest depth is tracked per block of this many pixels squared.
+  constexpr static unsigned depth_block_size{8};
+  using Layout = Blocked<depth_block_size>;
+
+  // D24 and D16 round depths to multiples of 2^-24 and 2^-16 and store them as
+  // integers, D16 in half the bytes.
+  enum class DepthFormat { D32F, D24, D16 };
+
+  FrameBuffer(unsigned width, unsigned height, DepthFormat depth_format = DepthFormat::D32F)
+      : color_{width, height},
+        depth_{depth_format == DepthFormat::D32F ? width : 0u,
+               depth_format == DepthFormat::D32F ? height : 0u},
+        depth24_{depth_format == DepthFormat::D24 ? width : 0u,
+                 depth_format == DepthFormat::D24 ? height : 0u},
+        depth16_{depth_format == DepthFormat::D16 ? width : 0u,
+                 depth_format == DepthFormat::D16 ? height : 0u},
+        depth_format_{depth_format}, blocks_x_{(width + depth_block_size - 1) / depth_block_size},
+        depth_blocks_(static_cast<size_t>(blocks_x_) *
+                      ((height + depth_block_size - 1) / depth_block_size)) {}
+
+  // Only marks the blocks as cleared; a block's texels are written when it is
+  // first drawn to, or by resolve().
+  void clear(UNorm color = 0u, float depth = 1.f) {
+    clear_color_ = color;
+    clear_depth_ = quantizeDepth(depth);
+    auto blocks_y = depth_blocks_.size() / blocks_x_;
+    for (auto by = 0u; by < blocks_y; ++by) {
+      auto height = std::min(depth_block_size, color_.getHeight() - by * depth_block_size);
+      for (auto bx = 0u; bx < blocks_x_; ++bx) {
+        auto width = std::min(depth_block_size, color_.getWidth() - bx * depth_block_size);
+        depth_blocks_[by * blocks_x_ + bx] = {clear_depth_, width * height, true};
+      }
+    }
+  }
 
-  void clear() {
-    color_.clear();
-    depth_.fill(1.f);
+  // Writes out the blocks that are still only marked as cleared.
+  void resolve() {
+    for (auto i = 0uz; i < depth_blocks_.size(); ++i) {
+      if (depth_blocks_[i].cleared)
+        materialize(i % blocks_x_, i / blocks_x_);
+    }
   }
 
   void setPixel(unsigned x, unsigned y, const Vec4 &color, float depth) {
+    auto &block = touchBlock(x, y);
     if (color_write_)
       color_.setTexel(x, y, color);
-    depth_.setTexel(x, y, depth);
+    updateDepth(block, x, y, quantizeDepth(depth));
+  }
+
+  void setDepth(unsigned x, unsigned y, float depth) {
+    updateDepth(touchBlock(x, y), x, y, quantizeDepth(depth));
+  }
+
+  // Rounds depth to the nearest value the depth format holds. Depths are
+  // stored, returned and compared rounded.
+  [[nodiscard]] float quantizeDepth(float depth) const {
+    switch (depth_format_) {
+    case DepthFormat::D24:
+      return quantize<24>(depth);
+    case DepthFormat::D16:
+      return quantize<16>(depth);
+    default:
+      return depth;
+    }
   }
 
   void setColorWrite(bool write) { color_write_ = write; }
-  [[nodiscard]] auto &getColorTexture() const { return color_; }
-  [[nodiscard]] auto &getDepthTexture() const { return depth_; }
-  auto getDepth(unsigned x, unsigned y) { return depth_.fetchTexel(x, y); }
-  [[nodiscard]] auto getWidth() const { return color_.getWidth(); }
-  [[nodiscard]] auto getHeight() const { return color_.getHeight(); }
+  [[nodiscard]] const auto &getColorTexture() {
+    resolve();
+    return color_;
+  }
+  // With D24 and D16 the depths are converted to floats on each call.
+  [[nodiscard]] const auto &getDepthTexture() {
+    resolve();
+    if (depth_format_ != DepthFormat::D32F) {
+      if (depth_.getWidth() != getWidth())
+        depth_ = {getWidth(), getHeight()};
+      for (auto y = 0u; y < getHeight(); ++y)
+        for (auto x = 0u; x < getWidth(); ++x)
+          depth_.setTexel(x, y, loadDepth(x, y));
+    }
+    return depth_;
+  }
+  float getDepth(unsigned x, unsigned y) {
+    return depth_blocks_[blockIndex(x, y)].cleared ? clear_depth_ : loadDepth(x, y);
+  }
+  // Farthest depth stored in the blocks overlapping the inclusive pixel
+  // rectangle [x0, x1] x [y0, y1]. Blocks are only written by the thread that
+  // owns them, so concurrent queries of disjoint tiles are safe.
+  float getMaxDepth(unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+    auto max = std::numeric_limits<float>::lowest();
+    for (auto by = y0 / depth_block_size; by <= y1 / depth_block_size; ++by) {
+      for (auto bx = x0 / depth_block_size; bx <= x1 / depth_block_size; ++bx) {
+        auto &block = depth_blocks_[by * blocks_x_ + bx];
+        if (!block.count)
+          updateBlock(bx, by);
+        max = std::max(max, block.max);
+      }
+    }
+    return max;
+  }
+  [[nodiscard]] unsigned getWidth() const { return color_.getWidth(); }
+  [[nodiscard]] unsigned getHeight() const { return color_.getHeight(); }
+  [[nodiscard]] auto getDepthFormat() const { return depth_format_; }
 
 private:
-  Texture<UNorm> color_;
-  Texture<float> depth_;
+  // A zero count means max is stale, but still not nearer than any texel. A
+  // cleared block's texels are yet to be written.
+  struct DepthBlock {
+    float max;
+    unsigned count;
+    bool cleared;
+  };
+
+  static_assert(Layout::span >= depth_block_size);
+
+  [[nodiscard]] size_t blockIndex(unsigned x, unsigned y) const {
+    return y / depth_block_size * blocks_x_ + x / depth_block_size;
+  }
+
+  DepthBlock &touchBlock(unsigned x, unsigned y) {
+    auto &block = depth_blocks_[blockIndex(x, y)];
+    if (block.cleared)
+      materialize(x / depth_block_size, y / depth_block_size);
+    return block;
+  }
+
+  void materialize(unsigned bx, unsigned by) {
+    auto x0 = bx * depth_block_size;
+    auto y0 = by * depth_block_size;
+    auto width = std::min(depth_block_size, getWidth() - x0);
+    auto height = std::min(depth_block_size, getHeight() - y0);
+    for (auto y = y0; y < y0 + height; ++y) {
+      std::fill_n(color_.getSpan(x0, y), width, clear_color_);
+      if (depth_format_ == DepthFormat::D24)
+        std::fill_n(depth24_.getSpan(x0, y), width, encodeDepth24(clear_depth_));
+      else if (depth_format_ == DepthFormat::D16)
+        std::fill_n(depth16_.getSpan(x0, y), width, encodeDepth16(clear_depth_));
+      else
+        std::fill_n(depth_.getSpan(x0, y), width, clear_depth_);
+    }
+    depth_blocks_[by * blocks_x_ + bx].cleared = false;
+  }
+
+  template <unsigned Bits> static float quantize(float depth) {
+    constexpr auto scale = static_cast<float>(1u << Bits);
+    return std::clamp(std::nearbyint(depth * scale), 0.f, scale - 1.f) / scale;
+  }
+
+  // Depths below are already quantized.
+  static uint32_t encodeDepth24(float depth) { return static_cast<uint32_t>(depth * 0x1p24f); }
+  static uint16_t encodeDepth16(float depth) { return static_cast<uint16_t>(depth * 0x1p16f); }
+
+  [[nodiscard]] float loadDepth(unsigned x, unsigned y) const {
+    if (depth_format_ == DepthFormat::D24)
+      return depth24_.fetchTexel(x, y) * 0x1p-24f;
+    if (depth_format_ == DepthFormat::D16)
+      return depth16_.fetchTexel(x, y) * 0x1p-16f;
+    return depth_.fetchTexel(x, y);
+  }
+
+  void storeDepth(unsigned x, unsigned y, float depth) {
+    if (depth_format_ == DepthFormat::D24)
+      depth24_.setTexel(x, y, encodeDepth24(depth));
+    else if (depth_format_ == DepthFormat::D16)
+      depth16_.setTexel(x, y, encodeDepth16(depth));
+    else
+      depth_.setTexel(x, y, depth);
+  }
+
+  void updateDepth(DepthBlock &block, unsigned x, unsigned y, float depth) {
+    auto old = loadDepth(x, y);
+    storeDepth(x, y, depth);
+
+    // Keep count of the texels at the block's farthest depth; once the last of
+    // them is overwritten with a nearer one, the block is rescanned on the
+    // next query.
+    if (depth > block.max) {
+      block.max = depth;
+      block.count = 1;
+      return;
+    }
+    if (!block.count)
+      return;
+    if (old == block.max)
+      --block.count;
+    if (depth == block.max)
+      ++block.count;
+  }
+
+  void updateBlock(unsigned bx, unsigned by) {
+    auto x0 = bx * depth_block_size;
+    auto y0 = by * depth_block_size;
+    auto x1 = std::min(x0 + depth_block_size, getWidth());
+    auto y1 = std::min(y0 + depth_block_size, getHeight());
+    auto &block = depth_blocks_[by * blocks_x_ + bx];
+
+#ifdef __AVX__
+    static_assert(depth_block_size == 8);
+    auto full = x1 - x0 == depth_block_size && y1 - y0 == depth_block_size;
+    if (full && depth_format_ == DepthFormat::D16) {
+      __m128i rows[depth_block_size];
+      for (auto i = 0u; i < depth_block_size; ++i)
+        rows[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth16_.getSpan(x0, y0 + i)));
+
+      auto max = rows[0];
+      for (auto i = 1u; i < depth_block_size; ++i)
+        max = _mm_max_epu16(max, rows[i]);
+      // The maximum is the complement of the minimum of the complements.
+      auto max16 = static_cast<uint16_t>(
+          ~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(max, _mm_set1_epi32(-1)))));
+      max = _mm_set1_epi16(static_cast<short>(max16));
+
+      auto count = 0;
+      for (auto i = 0u; i < depth_block_size; ++i)
+        count += std::popcount(
+            static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(rows[i], max))));
+      block.max = max16 * 0x1p-16f;
+      block.count = count / 2;
+      return;
+    }
+    if (full) {
+      // D24 texels are below 2^24, so they convert to floats exactly.
+      auto d24 = depth_format_ == DepthFormat::D24;
+      __m256 rows[depth_block_size];
+      for (auto i = 0u; i < depth_block_size; ++i)
+        rows[i] = d24 ? _mm256_cvtepi32_ps(_mm256_loadu_si256(
+                            reinterpret_cast<const __m256i *>(depth24_.getSpan(x0, y0 + i))))
+                      : _mm256_loadu_ps(depth_.getSpan(x0, y0 + i));
+
+      auto max = rows[0];
+      for (auto i = 1u; i < depth_block_size; ++i)
+        max = _mm256_max_ps(max, rows[i]);
+      max = _mm256_max_ps(max, _mm256_permute2f128_ps(max, max, 1));
+      max = _mm256_max_ps(max, _mm256_permute_ps(max, 0b01001110));
+      max = _mm256_max_ps(max, _mm256_permute_ps(max, 0b10110001));
+
+      auto count = 0;
+      for (auto i = 0u; i < depth_block_size; ++i)
+        count += std::popcount(
+            static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(rows[i], max, _CMP_EQ_OQ))));
+      block.max = _mm256_cvtss_f32(max) * (d24 ? 0x1p-24f : 1.f);
+      block.count = count;
+      return;
+    }
+#endif
+
+    block.max = std::numeric_limits<float>::lowest();
+    block.count = 0;
+    for (auto y = y0; y < y1; ++y) {
+      for (auto x = x0; x < x1; ++x) {
+        auto depth = loadDepth(x, y);
+        if (depth > block.max) {
+          block.max = depth;
+          block.count = 1;
+        } else if (depth == block.max) {
+          ++block.count;
+        }
+      }
+    }
+  }
+
+  Texture<UNorm, Layout> color_;
+  Texture<float, Layout> depth_; // D32F, or the converted depths of getDepthTexture().
+  Texture<uint32_t, Layout> depth24_;
+  Texture<uint16_t, Layout> depth16_;
+  DepthFormat depth_format_;
+  unsigned blocks_x_;
+  std::vector<DepthBlock> depth_blocks_;
+  UNorm clear_color_{0u};
+  float clear_depth_{1.f};
   bool color_write_{true};
 };
 
@@ -1,390 +1,514 @@
 #include <algorithm>
+#include <bit>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <variant>
 
 #ifdef __AVX__
 #include <immintrin.h>
 #endif
 
+#include "renderer/command_list.h"
 #include "renderer/pipeline.h"
+#include "renderer/raster_impl.h"
 
 namespace renderer {
 
+using namespace detail;
+
 namespace {
 
-struct Edge {
-  int eq;
-  int step_x;
-  int step_y;
-};
+// drawInstanced() goes through the instances in batches of about this many
+// triangles, which bounds the arenas and keeps them in cache.
+constexpr auto instance_batch = 1uz << 16;
+
+// Screen-space extent of the guard band in pixels. Coordinates within it keep
+// the fixed-point edge functions from overflowing.
+constexpr auto guard_band = 2048.f;
+
+// Signed distance to the plane of a clipping code, non-negative inside.
+float planeDistance(const Vec4 &pos, uint16_t plane, float guard_x, float guard_y) {
+  switch (plane) {
+  case clip_near:
+    return pos.z + pos.w;
+  case guard_left:
+    return pos.x + guard_x * pos.w;
+  case guard_right:
+    return guard_x * pos.w - pos.x;
+  case guard_bottom:
+    return pos.y + guard_y * pos.w;
+  default:
+    return guard_y * pos.w - pos.y;
+  }
+}
 
-float lerp(float a, float b, float w) { return (1.f - w) * a + w * b; }
+// Whether box, taken to clip space by clip, lies outside one of the frustum
+// planes altogether.
+bool isOutside(const Aabb &box, const Mat4 &clip) {
+  auto codes = frustum_codes;
+  for (auto i = 0u; i < 8 && codes; ++i) {
+    Vec4 corner{i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y,
+                i & 4 ? box.max.z : box.min.z, 1.f};
+    codes &= clipCode(clip * corner, 1.f, 1.f);
+  }
+  return codes;
+}
 
-Edge setup_edge(int x1, int y1, int x2, int y2, int x_start, int y_start, int prec) {
-  auto dx = x2 - x1;
-  auto dy = y2 - y1;
-  auto bias = dy < 0 || (dy == 0 && dx < 0) ? 0 : -1;
+// Mixes size bytes at data into hash h, eight at a time. Callers hash the
+// sizes too, since zero bytes at the end do not change the result.
+uint64_t hashBytes(const void *data, size_t size, uint64_t h) {
+  constexpr uint64_t mul{0x9e3779b97f4a7c15};
+  auto p = static_cast<const unsigned char *>(data);
+  uint64_t word;
+  for (; size >= 8; p += 8, size -= 8) {
+    std::memcpy(&word, p, 8);
+    h = std::rotl((h ^ word) * mul, 29);
+  }
+  word = 0;
+  std::memcpy(&word, p, size);
+  return std::rotl((h ^ word) * mul, 29);
+}
 
-  int e = (static_cast<long long>(dx) * (y_start - y2) -
-           static_cast<long long>(dy) * (x_start - x2) + bias) >>
-          prec;
-  return {.eq = e, .step_x = dy, .step_y = dx};
+template <class T> uint64_t hashValue(T value, uint64_t h) {
+  static_assert(std::is_scalar_v<T>);
+  return hashBytes(&value, sizeof value, h);
 }
 
-void precomputeAttrs(const Triangle &tri, unsigned attr_count) {
-  if (!attr_count)
-    return;
+} // namespace
 
-  float *in[] = {reinterpret_cast<float *>(tri.v[0]->attr),
-                 reinterpret_cast<float *>(tri.v[1]->attr),
-                 reinterpret_cast<float *>(tri.v[2]->attr)};
+void Pipeline::setThreadCount(unsigned count) {
+  if (count == getThreadCount())
+    return;
+  pool_ = count > 1 ? std::make_unique<ThreadPool>(count) : nullptr;
+}
 
-#ifdef __AVX__
-  auto w0 = _mm256_broadcast_ss(&tri.v[0]->pos.w);
-  auto w1 = _mm256_broadcast_ss(&tri.v[1]->pos.w);
-  auto w2 = _mm256_broadcast_ss(&tri.v[2]->pos.w);
-
-  auto vecs = (attr_count + 7) / 8;
-  for (auto i = 0u; i < vecs; ++i) {
-    auto in0 = _mm256_load_ps(in[0]);
-    auto in1 = _mm256_load_ps(in[1]);
-    auto in2 = _mm256_load_ps(in[2]);
-    auto attr0 = _mm256_mul_ps(in0, w0);
-    _mm256_store_ps(in[1], _mm256_sub_ps(_mm256_mul_ps(in1, w1), attr0));
-    _mm256_store_ps(in[2], _mm256_sub_ps(_mm256_mul_ps(in2, w2), attr0));
-    _mm256_store_ps(in[0], attr0);
-
-    in[0] += 8;
-    in[1] += 8;
-    in[2] += 8;
-  }
-#else
-  auto w0 = tri.v[0]->pos.w;
-  auto w1 = tri.v[1]->pos.w;
-  auto w2 = tri.v[2]->pos.w;
-
-  for (auto i = 0u; i < attr_count; ++i) {
-    auto attr0 = in[0][i] * w0;
-    in[1][i] = in[1][i] * w1 - attr0;
-    in[2][i] = in[2][i] * w2 - attr0;
-    in[0][i] = attr0;
-  }
-#endif
+bool Pipeline::isOutOfView(const void *instance_data) const {
+  return vb_->bounds && prog_->clip_transform &&
+         isOutside(*vb_->bounds, prog_->clip_transform(uniform_, instance_data));
 }
 
-} // namespace
+bool Pipeline::cullDraw() {
+  if (!isOutOfView(nullptr))
+    return false;
+  stats_.submitted += (ib_ ? ib_->count : vb_->count) / 3;
+  ++stats_.draws_culled;
+  return true;
+}
 
 void Pipeline::draw() {
   assert(vb_);
   assert(prog_);
+  if (!cullDraw())
+    execute();
+}
 
-  vert_arena_.reset(vb_->count, sizeof(VertexH), alignof(VertexH));
-  attr_arena_.reset(vb_->count, (prog_->attr_count + 7) / 8 * 32, 32);
+void Pipeline::drawInstanced(unsigned count, const void *instance_data, size_t instance_stride) {
+  assert(vb_);
+  assert(prog_ && prog_->vs_instance);
+  instance_data_ = static_cast<const char *>(instance_data);
+  instance_stride_ = instance_stride;
+  instances_.clear();
+  for (auto i = 0u; i < count; ++i) {
+    if (!isOutOfView(instance_data_ ? instance_data_ + i * instance_stride : nullptr))
+      instances_.push_back(i);
+  }
 
-  stats_.submitted += vb_->count / 3;
+  auto instance_tris = (ib_ ? ib_->count : vb_->count) / 3;
+  stats_.submitted += (count - instances_.size()) * instance_tris;
+  stats_.draws_culled += count - instances_.size();
+  auto batch = std::max(instance_batch / std::max(instance_tris, 1uz), 1uz);
+  instanced_ = true;
+  for (instance_first_ = 0; instance_first_ < instances_.size(); instance_first_ += batch) {
+    instance_count_ = std::min(batch, instances_.size() - instance_first_);
+    execute();
+  }
+  instance_first_ = 0;
+  instance_count_ = 1;
+  instance_data_ = nullptr;
+  instanced_ = false;
+}
+
+void Pipeline::replay(CommandList &list) {
+  if (auto error = list.validate(); !error.empty())
+    throw std::invalid_argument{error};
+  const void *uniform = nullptr;
+  auto uniform_size = 0uz;
+  for (auto &command : list.commands_) {
+    std::visit(
+        [&]<class T>(const T &cmd) {
+          if constexpr (std::is_same_v<T, CommandList::VertexBufferCmd>) {
+            setVertexBuffer(cmd.vb);
+          } else if constexpr (std::is_same_v<T, CommandList::IndexBufferCmd>) {
+            setIndexBuffer(cmd.ib);
+          } else if constexpr (std::is_same_v<T, CommandList::ProgramCmd>) {
+            setProgram(cmd.program);
+          } else if constexpr (std::is_same_v<T, CommandList::UniformCmd>) {
+            setUniform(cmd.ptr);
+            uniform = cmd.ptr;
+            uniform_size = cmd.size;
+          } else if constexpr (std::is_same_v<T, CommandList::CullingCmd>) {
+            setCulling(cmd.mode);
+          } else if constexpr (std::is_same_v<T, CommandList::PassCmd>) {
+            setPass(cmd.pass);
+          } else if constexpr (std::is_same_v<T, CommandList::WireframeCmd>) {
+            setWireframeMode(cmd.mode);
+          } else if constexpr (std::is_same_v<T, CommandList::DrawInstancedCmd>) {
+            drawInstanced(cmd.count, cmd.data, cmd.stride);
+          } else {
+            static_assert(std::is_same_v<T, CommandList::DrawCmd>);
+            // The cached triangles of a culled draw stay for when it comes back.
+            if (!cullDraw())
+              execute(&list.cache_[cmd.cache], transformKey(uniform, uniform_size));
+          }
+        },
+        command);
+  }
+}
+
+// Hashes everything transform() reads: the program, the uniform block, the
+// framebuffer size setting the guard band, and the vertex and index buffers,
+// which stand for their contents along with their generation.
+uint64_t Pipeline::transformKey(const void *uniform, size_t uniform_size) const {
+  auto h = hashValue(prog_, 0);
+  h = hashValue(fb_->getWidth(), h);
+  h = hashValue(fb_->getHeight(), h);
+  h = hashValue(vb_->ptr, h);
+  h = hashValue(vb_->count, h);
+  h = hashValue(vb_->stride, h);
+  h = hashValue(vb_->generation, h);
+  if (ib_) {
+    h = hashValue(ib_->ptr, h);
+    h = hashValue(ib_->count, h);
+    h = hashValue(ib_->type, h);
+    h = hashValue(ib_->generation, h);
+  }
+  h = hashValue(uniform_size, h);
+  return uniform_size ? hashBytes(uniform, uniform_size, h) : h;
+}
+
+void Pipeline::execute(TransformCache *cache, uint64_t key) {
+  assert(vb_);
+  assert(prog_ && (instanced_ || variants_ || prog_->vs));
+
+  auto reuse = cache && cache->valid && cache->key == key;
+  guard_x_ = std::max(1.f, guard_band / (fb_->getWidth() - 1));
+  guard_y_ = std::max(1.f, guard_band / (fb_->getHeight() - 1));
+  if (!reuse) {
+    // Every instance has its own slots in the arenas.
+    vert_arena_.reset(vb_->count * instance_count_, sizeof(VertexH), alignof(VertexH));
+    attr_arena_.reset(vb_->count * instance_count_, attrBlockSize(prog_->attr_count), 32);
+  }
+  stats_.threads.resize(getThreadCount());
+  if (trace_)
+    trace_->beginDraw();
+
+  auto submitted = (ib_ ? ib_->count : vb_->count) / 3 * instance_count_;
+  auto drawn = stats_.drawn;
+  auto fragments = stats_.fragments;
+  auto packets = stats_.packets;
+  stats_.submitted += submitted;
+  auto &variant = getVariant();
   auto t0 = std::chrono::steady_clock::now();
-  auto triangles = transform();
+  std::vector<Triangle> triangles;
+  if (reuse) {
+    // Rasterizing leaves the vertices alone, but rewrites the triangles.
+    triangles = cache->triangles;
+    stats_.clipped += cache->clipped;
+    stats_.rejected += cache->rejected;
+    ++stats_.draws_reused;
+  } else {
+    auto clipped = stats_.clipped;
+    auto rejected = stats_.rejected;
+    triangles = (this->*variant.transform)();
+    if (cache) {
+      // Hand the storage the triangles point into to the cache, and take its
+      // old storage in exchange.
+      std::swap(vert_arena_, cache->vert_arena);
+      std::swap(attr_arena_, cache->attr_arena);
+      std::swap(chunks_, cache->chunks);
+      cache->triangles = triangles;
+      cache->clipped = stats_.clipped - clipped;
+      cache->rejected = stats_.rejected - rejected;
+      cache->key = key;
+      cache->valid = true;
+    }
+  }
   auto t1 = std::chrono::steady_clock::now();
-  rasterize(triangles);
+  (this->*variant.rasterize)(triangles);
   auto t2 = std::chrono::steady_clock::now();
   stats_.vtx_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
   stats_.raster_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+  // Attributes are interpolated per fragment, or for all lanes of a packet.
+  sumThreadStats();
+  auto lanes = prog_->fs_packet && !wireframe_ ? 8 * (stats_.packets - packets)
+                                               : stats_.fragments - fragments;
+  stats_.attr_bytes += lanes * prog_->attr_count * sizeof(float);
+
+  if (trace_) {
+    trace_->addEvent("draw", t0, t2,
+                     {{"instances", instance_count_},
+                      {"reused", reuse},
+                      {"submitted", submitted},
+                      {"drawn", stats_.drawn - drawn},
+                      {"fragments", stats_.fragments - fragments}});
+  }
 }
 
-std::vector<Triangle> Pipeline::transform() {
-  auto buf = static_cast<const char *>(vb_->ptr);
-  auto tri_count = vb_->count / 3;
-  std::vector<Triangle> out{tri_count};
+const Pipeline::Variant &Pipeline::getVariant() const {
+  auto &variants = variants_ ? *variants_ : getVariants<DynamicShading>();
+  auto index = (wireframe_ * culling_modes + static_cast<unsigned>(culling_)) * attr_vec_counts +
+               (prog_->attr_count + 7) / 8;
+  return variants[index];
+}
 
-  auto tri_idx = 0u;
-  for (auto i = 0u; i < tri_count; ++i) {
-    auto clipped = 0u;
+// The line fill the benchmarks time, as they go without raster_impl.h.
+template void Pipeline::fill<Pipeline::DynamicShading>(const VertexH &v1, const VertexH &v2,
+                                                       float x, float y, float w,
+                                                       const Tile &tile);
+
+void Pipeline::sumThreadStats() {
+  stats_.fragments = 0;
+  stats_.packets = 0;
+  stats_.blocks_accepted = 0;
+  stats_.blocks_rejected = 0;
+  stats_.blocks_partial = 0;
+  stats_.blocks_occluded = 0;
+  stats_.triangles_occluded = 0;
+  stats_.depth_tests = 0;
+  stats_.depth_passed = 0;
+  for (auto &thread : stats_.threads) {
+    stats_.fragments += thread.fragments;
+    stats_.packets += thread.packets;
+    stats_.blocks_accepted += thread.blocks_accepted;
+    stats_.blocks_rejected += thread.blocks_rejected;
+    stats_.blocks_partial += thread.blocks_partial;
+    stats_.blocks_occluded += thread.blocks_occluded;
+    stats_.triangles_occluded += thread.triangles_occluded;
+    stats_.depth_tests += thread.depth_tests;
+    stats_.depth_passed += thread.fragments + thread.depth_writes;
+  }
+}
 
-    // Assemble a triangle.
-    auto &tri = out[tri_idx];
-    for (auto &v : tri.v) {
-      v = vert_arena_.allocate<VertexH>();
-      v->attr = attr_arena_.allocate<void>();
-      prog_->vs(*reinterpret_cast<const Vertex *>(buf), uniform_, *v);
+// Builds triangles [first, last) from vertices cached by shadeIndexed().
+void Pipeline::assembleIndexed(size_t first, size_t last, TransformChunk &out) {
+  auto instance_tris = ib_->count / 3;
+  withIndices(*ib_, [&](auto indices) {
+    auto instance = first / instance_tris;
+    auto local = first - instance * instance_tris;
+    for (auto i = first; i < last; ++i, ++local) {
+      if (local == instance_tris) {
+        local = 0;
+        ++instance;
+      }
+      auto index = &indices[local * 3];
+      auto base = instance * vb_->count;
+      size_t slots[] = {base + index[0], base + index[1], base + index[2]};
+      uint16_t codes[] = {vert_flags_[slots[0]], vert_flags_[slots[1]], vert_flags_[slots[2]]};
+      if (codes[0] & codes[1] & codes[2] & frustum_codes) {
+        ++out.rejected_count;
+        continue;
+      }
 
-      // Clip trivially rejectable.
-      if (v->pos.x > v->pos.w || v->pos.x < -v->pos.w || v->pos.y > v->pos.w ||
-          v->pos.y < -v->pos.w || v->pos.z > v->pos.w || v->pos.z < -v->pos.w)
-        ++clipped;
+      VertexH *verts[3];
+      for (auto j = 0u; j < 3; ++j)
+        verts[j] = vert_arena_.at<VertexH>(slots[j]);
 
-      buf += vb_->stride;
+      auto codes_any = static_cast<uint16_t>(codes[0] | codes[1] | codes[2]);
+      if (codes_any & clipping_codes) {
+        Vec4 pos[] = {clip_pos_[slots[0]], clip_pos_[slots[1]], clip_pos_[slots[2]]};
+        clipTriangle(verts, pos, codes_any, out);
+      } else {
+        out.triangles.push_back({{verts[0], verts[1], verts[2]}, nullptr});
+      }
     }
+  });
+}
 
-    if (clipped == 3)
+// Sutherland-Hodgman in clip space against the near plane and the guard band
+// planes in codes, then fans the polygon out into triangles. Vertices verts
+// are already projected and pos holds their clip-space positions.
+void Pipeline::clipTriangle(VertexH *const (&verts)[3], const Vec4 (&pos)[3], uint16_t codes,
+                            TransformChunk &out) const {
+  struct PolyVertex {
+    Vec4 pos;
+    VertexH *vert;
+  };
+  // Every plane adds at most one vertex.
+  constexpr auto max_verts = 3 + 5;
+  PolyVertex poly[2][max_verts];
+  auto count = 3u;
+  for (auto i = 0u; i < 3; ++i)
+    poly[0][i] = {pos[i], verts[i]};
+
+  auto attr_count = prog_->attr_count;
+  auto src = 0u;
+  for (uint16_t plane : {clip_near, guard_left, guard_right, guard_bottom, guard_top}) {
+    if (!(codes & plane))
       continue;
 
-    for (auto vert : tri.v) {
-      // To NDC.
-      auto z_recipr = 1.f / vert->pos.w;
-      vert->pos.x *= z_recipr;
-      vert->pos.y *= z_recipr;
-      vert->pos.z *= z_recipr;
-      vert->pos.w = z_recipr;
-
-      // To screen space.
-      auto width = fb_->getWidth();
-      auto height = fb_->getHeight();
-      vert->pos.x = (vert->pos.x * (width - 1) + width - 1) * .5f;
-      vert->pos.y = (vert->pos.y * (height - 1) + height - 1) * .5f;
-      vert->pos.z = vert->pos.z * .5f + .5f;
-    }
-    ++tri_idx;
-  }
-  out.resize(tri_idx);
-
-  return out;
-}
-
-void Pipeline::rasterize(std::vector<Triangle> &triangles) {
-  for (auto &tri : triangles) {
-    if (wireframe_) {
-      // TODO: Deal with the duplication of the area calculation.
-      auto area = (tri.v[1]->pos.x - tri.v[0]->pos.x) * (tri.v[2]->pos.y - tri.v[0]->pos.y) -
-                  (tri.v[2]->pos.x - tri.v[0]->pos.x) * (tri.v[1]->pos.y - tri.v[0]->pos.y);
-      if ((culling_ == Culling::BackFacing && area <= 0.f) ||
-          (culling_ == Culling::FrontFacing && area >= 0.f))
-        continue;
-      // Reject degenerate triangles like the half-space path does, so
-      // stats_.drawn means the same thing in both modes.
-      if (area == 0.f)
+    auto in = poly[src];
+    auto clipped = poly[src ^ 1];
+    auto clipped_count = 0u;
+    for (auto i = 0u; i < count; ++i) {
+      auto &a = in[i];
+      auto &b = in[(i + 1) % count];
+      auto da = planeDistance(a.pos, plane, guard_x_, guard_y_);
+      auto db = planeDistance(b.pos, plane, guard_x_, guard_y_);
+      if (da >= 0.f)
+        clipped[clipped_count++] = a;
+      if ((da >= 0.f) == (db >= 0.f))
         continue;
-      ++stats_.drawn;
-      rasterizeLine(*tri.v[0], *tri.v[1]);
-      rasterizeLine(*tri.v[0], *tri.v[2]);
-      rasterizeLine(*tri.v[1], *tri.v[2]);
-    } else {
-      rasterizeTriHalfSpace(tri);
+
+      // The edge crosses the plane; attributes are linear in clip space.
+      auto t = da / (da - db);
+      auto &v = out.clipped.emplace_back();
+      auto attr_a = static_cast<const float *>(a.vert->attr);
+      auto attr_b = static_cast<const float *>(b.vert->attr);
+      for (auto j = 0u; j < attr_count; ++j)
+        v.attr[j] = attr_a[j] + (attr_b[j] - attr_a[j]) * t;
+      v.vert.attr = v.attr;
+      clipped[clipped_count++] = {a.pos + (b.pos - a.pos) * t, &v.vert};
     }
-  }
-}
 
-// Bresenham's line algorithm.
-void Pipeline::rasterizeLine(const VertexH &v0, const VertexH &v1) {
-  int x0 = v0.pos.x;
-  int x1 = v1.pos.x;
-  int y0 = v0.pos.y;
-  int y1 = v1.pos.y;
-  auto from = &v0;
-  auto to = &v1;
-  auto steep = false;
-  if (std::abs(y1 - y0) > std::abs(x1 - x0)) {
-    steep = true;
-    std::swap(x0, y0);
-    std::swap(x1, y1);
-  }
-  if (x0 > x1) {
-    std::swap(from, to);
-    std::swap(x0, x1);
-    std::swap(y0, y1);
+    src ^= 1;
+    count = clipped_count;
+    if (count < 3)
+      return;
   }
 
-  int y = y0;
-  int dx = x1 - x0;
-  int dy = std::abs(y1 - y0);
-  auto diff = 2 * dy - dx;
-  int y_growth = y1 > y0 ? 1 : -1;
-  auto w_step = 1.f / dx;
-  auto w = 0.f;
-
-  if (steep)
-    fill(*from, *to, y0, x0, w);
-  else
-    fill(*from, *to, x0, y0, w);
-
-  if (diff > 0) {
-    y += y_growth;
-    diff -= 2 * dx;
-  }
-  for (int x = x0 + 1; x <= x1; ++x) {
-    w += w_step;
-    if (steep)
-      fill(*from, *to, y, x, w);
-    else
-      fill(*from, *to, x, y, w);
-
-    diff += 2 * dy;
-    if (diff > 0) {
-      y += y_growth;
-      diff -= 2 * dx;
+  // New vertices get projected; the originals already are.
+  for (auto i = 0u; i < count; ++i) {
+    auto &p = poly[src][i];
+    if (p.vert != verts[0] && p.vert != verts[1] && p.vert != verts[2]) {
+      p.vert->pos = p.pos;
+      project(*p.vert);
     }
   }
+  auto fan = poly[src];
+  for (auto i = 1u; i + 1 < count; ++i)
+    out.triangles.push_back({{fan[0].vert, fan[i].vert, fan[i + 1].vert}, nullptr});
+  ++out.clipped_count;
 }
 
-// Top-left filling convention.
-void Pipeline::rasterizeTriHalfSpace(Triangle &tri) {
-  // 8 bit sub pixel precision.
-  constexpr auto prec_bits = 8;
-  constexpr auto step = 1 << prec_bits;
-  constexpr auto mask = ~(step - 1);
-  constexpr auto offset = (step - 1) >> 1;
-  constexpr auto scale = static_cast<float>(step);
-
-  int x0 = tri.v[0]->pos.x * scale;
-  int x1 = tri.v[1]->pos.x * scale;
-  int x2 = tri.v[2]->pos.x * scale;
-  int y0 = tri.v[0]->pos.y * scale;
-  int y1 = tri.v[1]->pos.y * scale;
-  int y2 = tri.v[2]->pos.y * scale;
-
-  // Culling and degenerate triangle handling.
-  int area =
-      (static_cast<long long>(x1 - x0) * (y2 - y0) - static_cast<long long>(y1 - y0) * (x2 - x0)) >>
-      prec_bits;
-
-  auto reverse_winding = [&]() {
-    std::swap(tri.v[1], tri.v[2]);
-    std::swap(x1, x2);
-    std::swap(y1, y2);
-    area = -area;
-  };
+// Clip space to screen space.
+void Pipeline::project(VertexH &vert) const {
+  auto width = fb_->getWidth();
+  auto height = fb_->getHeight();
+
+  // To NDC.
+  auto z_recipr = 1.f / vert.pos.w;
+  vert.pos.x *= z_recipr;
+  vert.pos.y *= z_recipr;
+  vert.pos.z *= z_recipr;
+  vert.pos.w = z_recipr;
+
+  // To screen space.
+  vert.pos.x = (vert.pos.x * (width - 1) + width - 1) * .5f;
+  vert.pos.y = (vert.pos.y * (height - 1) + height - 1) * .5f;
+  vert.pos.z = vert.pos.z * .5f + .5f;
+}
 
-  switch (culling_) {
-  case Culling::None:
-    if (area < 0)
-      reverse_winding();
-    break;
-  case Culling::BackFacing:
-    if (area <= 0)
-      return;
-    break;
-  case Culling::FrontFacing:
-    if (area < 0) {
-      reverse_winding();
-      break;
-    }
-    return;
-  }
-  if (area == 0)
+// Early Z-test and queueing for packet shading.
+void Pipeline::gather(PacketQueue &queue, const Triangle &tri, float x, float y, float w0,
+                      float w1, float w2, const Tile &tile) {
+  auto z_s = w0 * tri.v[0]->pos.z + w1 * tri.v[1]->pos.z + w2 * tri.v[2]->pos.z;
+  if (!earlyDepthTest(z_s, x, y, *tile.stats))
     return;
-  ++stats_.drawn;
-
-  auto area_rec = 1.f / area;
-
-  auto aabb_x = std::minmax({x0, x1, x2});
-  auto aabb_y = std::minmax({y0, y1, y2});
-  aabb_x = {std::max(0, aabb_x.first),
-            std::min(static_cast<int>(fb_->getWidth() - 1) << prec_bits, aabb_x.second)};
-  aabb_y = {std::max(0, aabb_y.first),
-            std::min(static_cast<int>(fb_->getHeight() - 1) << prec_bits, aabb_y.second)};
-
-  auto x_start = (aabb_x.first & mask) + offset;
-  auto y_start = (aabb_y.first & mask) + offset;
-  auto x_end = (aabb_x.second & mask) + offset;
-  auto y_end = (aabb_y.second & mask) + offset;
-
-  auto edge0 = setup_edge(x1, y1, x2, y2, x_start, y_start, prec_bits);
-  auto edge1 = setup_edge(x2, y2, x0, y0, x_start, y_start, prec_bits);
-  auto edge2 = setup_edge(x0, y0, x1, y1, x_start, y_start, prec_bits);
-
-  precomputeAttrs(tri, prog_->attr_count);
-
-  x_end >>= prec_bits;
-  y_end >>= prec_bits;
-  for (auto y = y_start >> prec_bits; y <= y_end; ++y) {
-    auto e0 = edge0.eq;
-    auto e1 = edge1.eq;
-    auto e2 = edge2.eq;
-
-    for (auto x = x_start >> prec_bits; x <= x_end; ++x) {
-      if ((e0 | e1 | e2) >= 0) {
-        auto w0 = e0 * area_rec;
-        auto w1 = e1 * area_rec;
-        auto w2 = 1 - w0 - w1;
-
-        fill(tri, x, y, w0, w1, w2);
-      }
-      e0 -= edge0.step_x;
-      e1 -= edge1.step_x;
-      e2 -= edge2.step_x;
-    }
 
-    edge0.eq += edge0.step_y;
-    edge1.eq += edge1.step_y;
-    edge2.eq += edge2.step_y;
-  }
+  auto i = queue.count++;
+  queue.x[i] = x;
+  queue.y[i] = y;
+  queue.z[i] = z_s;
+  queue.w[0][i] = w0;
+  queue.w[1][i] = w1;
+  queue.w[2][i] = w2;
+  queue.mask |= 1u << i;
+
+  if (queue.count == 8)
+    shadePacket(queue, tri, tile);
 }
 
-void Pipeline::fill(const VertexH &v1, const VertexH &v2, float x, float y, float w) {
-  auto z_s = lerp(v1.pos.z, v2.pos.z, w);
-
-  // Early Z-test.
-  if (z_s >= fb_->getDepth(x, y))
+// Early Z-test of the fragments in mask of the quad at (x, y), which is queued
+// whole if any of them passes.
+void Pipeline::gatherQuad(PacketQueue &queue, const Triangle &tri, int x, int y, unsigned mask,
+                          const float (&w0)[4], const float (&w1)[4], const Tile &tile) {
+  auto base = queue.count;
+  for (auto i = 0u; i < 4; ++i) {
+    auto lane = base + i;
+    auto w2 = 1 - w0[i] - w1[i];
+    auto z_s = w0[i] * tri.v[0]->pos.z + w1[i] * tri.v[1]->pos.z + w2 * tri.v[2]->pos.z;
+    queue.x[lane] = x + (i & 1);
+    queue.y[lane] = y + (i >> 1);
+    queue.z[lane] = z_s;
+    queue.w[0][lane] = w0[i];
+    queue.w[1][lane] = w1[i];
+    queue.w[2][lane] = w2;
+    if (mask >> i & 1 && !earlyDepthTest(z_s, queue.x[lane], queue.y[lane], *tile.stats))
+      mask &= ~(1u << i);
+  }
+  if (!mask)
     return;
 
-  auto z_v = lerp(v1.pos.w, v2.pos.w, w);
-
-  Fragment frag;
-  float storage[max_attr_size];
-  frag.attr = &storage;
-  const float *in[] = {static_cast<const float *>(v1.attr), static_cast<const float *>(v2.attr)};
-  frag.coord.x = x;
-  frag.coord.y = y;
-  frag.coord.z = z_s;
-
-  for (auto i = 0u; i < prog_->attr_count; ++i) {
-    storage[i] = lerp(*(in[0] + i) * v1.pos.w, *(in[1] + i) * v2.pos.w, w) / z_v;
-  }
-  invokeFragmentShader(frag);
+  queue.mask |= mask << base;
+  queue.count += 4;
+  if (queue.count == 8)
+    shadePacket(queue, tri, tile);
 }
 
-void Pipeline::fill(const Triangle &tri, float x, float y, float w0, float w1, float w2) {
-  auto z_s = w0 * tri.v[0]->pos.z + w1 * tri.v[1]->pos.z + w2 * tri.v[2]->pos.z;
-
-  // Early Z-test.
-  if (z_s >= fb_->getDepth(x, y))
-    return;
-
-  Fragment frag;
-  alignas(32) float storage[max_attr_size];
-  frag.attr = &storage;
+void Pipeline::shadePacket(PacketQueue &queue, const Triangle &tri, const Tile &tile) {
+  for (auto i = queue.count; i < 8; ++i) {
+    queue.x[i] = queue.x[0];
+    queue.y[i] = queue.y[0];
+    queue.z[i] = queue.z[0];
+    queue.w[0][i] = queue.w[0][0];
+    queue.w[1][i] = queue.w[1][0];
+    queue.w[2][i] = queue.w[2][0];
+  }
+  auto mask = queue.mask;
+  queue.mask = 0;
+  queue.count = 0;
 
-  frag.coord.x = x;
-  frag.coord.y = y;
-  frag.coord.z = z_s;
+  FragmentPacket packet;
+  packet.x = Float8::load(queue.x);
+  packet.y = Float8::load(queue.y);
+  packet.z = Float8::load(queue.z);
+  packet.mask = mask;
 
-  // Interpolate attributes.
+  // Interpolate attributes, the same way fill() does for a single fragment.
   if (prog_->attr_count) {
-    const float *in[] = {reinterpret_cast<float *>(tri.v[0]->attr),
-                         reinterpret_cast<float *>(tri.v[1]->attr),
-                         reinterpret_cast<float *>(tri.v[2]->attr)};
-    auto z_v_rec = 1.f / (w0 * tri.v[0]->pos.w + w1 * tri.v[1]->pos.w + w2 * tri.v[2]->pos.w);
+    auto stride = attrBlockSize(prog_->attr_count) / sizeof(float);
+    const float *in[] = {tri.attr, tri.attr + stride, tri.attr + 2 * stride};
+    auto w0 = Float8::load(queue.w[0]);
+    auto w1 = Float8::load(queue.w[1]);
+    auto w2 = Float8::load(queue.w[2]);
+    auto z_v_rec =
+        1.f / (w0 * tri.v[0]->pos.w + w1 * tri.v[1]->pos.w + w2 * tri.v[2]->pos.w);
 
-#ifdef __AVX__
-    auto vw1 = _mm256_broadcast_ss(&w1);
-    auto vw2 = _mm256_broadcast_ss(&w2);
-    auto vz_rec = _mm256_broadcast_ss(&z_v_rec);
-
-    auto vecs = (prog_->attr_count + 7) / 8;
-    for (auto i = 0uz; i < vecs; ++i) {
-      auto in0 = _mm256_load_ps(in[0] + i * 8);
-      auto in1 = _mm256_load_ps(in[1] + i * 8);
-      auto in2 = _mm256_load_ps(in[2] + i * 8);
-      _mm256_store_ps(&storage[i * 8],
-                      _mm256_mul_ps(_mm256_add_ps(in0, _mm256_add_ps(_mm256_mul_ps(in1, vw1),
-                                                                     _mm256_mul_ps(in2, vw2))),
-                                    vz_rec));
-    }
-#else
     for (auto i = 0u; i < prog_->attr_count; ++i)
-      storage[i] = (in[0][i] + in[1][i] * w1 + in[2][i] * w2) * z_v_rec;
-#endif
+      packet.attr[i] = (in[0][i] + (in[1][i] * w1 + in[2][i] * w2)) * z_v_rec;
   }
 
-  invokeFragmentShader(frag);
-}
-
-void Pipeline::invokeFragmentShader(const Fragment &frag) {
-  ++stats_.fragments;
-  Vec4 color;
-  prog_->fs(frag, uniform_, color);
-  fb_->setPixel(frag.coord.x, frag.coord.y, color, frag.coord.z);
+  Vec4x8 color;
+  prog_->fs_packet(packet, uniform_, color);
+  tile.stats->fragments += std::popcount(mask);
+  ++tile.stats->packets;
+
+  alignas(32) float out[4][8];
+  color.x.store(out[0]);
+  color.y.store(out[1]);
+  color.z.store(out[2]);
+  color.w.store(out[3]);
+  for (; mask; mask &= mask - 1) {
+    auto i = std::countr_zero(mask);
+    fb_->setPixel(queue.x[i], queue.y[i], {out[0][i], out[1][i], out[2][i], out[3][i]},
+                  queue.z[i]);
+  }
 }
 
 } // namespace renderer
@@ -1,15 +1,26 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include "renderer/arena.h"
 #include "renderer/framebuffer.h"
 #include "renderer/matrix.h"
+#include "renderer/simd.h"
+#include "renderer/thread_pool.h"
+#include "renderer/trace.h"
 #include "renderer/vector.h"
 
 namespace renderer {
 
+class CommandList;
+
 struct Vertex {
   Vec3 pos;
 };
@@ -24,69 +35,365 @@ struct Fragment {
   void *attr;
 };
 
+// Up to eight fragments of one triangle in SoA layout. Lanes outside mask
+// repeat a live fragment, so shaders may compute all of them unconditionally.
+// For programs with fs_quads the lanes are two 2x2 quads instead, 0-3 and 4-7,
+// each ordered (x, y), (x + 1, y), (x, y + 1), (x + 1, y + 1); lanes outside
+// mask are helpers interpolated from the same triangle.
+struct FragmentPacket {
+  Float8 x;
+  Float8 y;
+  Float8 z;
+  Float8 attr[16]; // attr[i] holds attribute float i of every lane.
+  unsigned mask;
+};
+
+// Axis-aligned box; empty until extended by a point.
+struct Aabb {
+  Vec3 min{std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+           std::numeric_limits<float>::infinity()};
+  Vec3 max{-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+           -std::numeric_limits<float>::infinity()};
+
+  void extend(const Vec3 &p) {
+    for (auto i = 0u; i < 3; ++i) {
+      min[i] = std::min(min[i], p[i]);
+      max[i] = std::max(max[i], p[i]);
+    }
+  }
+};
+
 struct VertexBuffer {
   const void *ptr;
   size_t count;
   unsigned stride;
+  // Optional; object-space bounds of the positions, see Program::clip_transform.
+  const Aabb *bounds{};
+  // To be bumped whenever the vertices change, for CommandList replays to notice.
+  uint64_t generation{};
+};
+
+struct IndexBuffer {
+  enum class Type { U16, U32 };
+
+  const void *ptr;
+  size_t count;
+  Type type;
+  uint64_t generation{}; // See VertexBuffer::generation.
 };
 
 using VertexShader = void (*)(const Vertex &in, const void *u, VertexH &out);
+// Also gets the index of the instance being drawn and its data.
+using InstanceVertexShader = void (*)(const Vertex &in, const void *u, unsigned instance,
+                                      const void *instance_data, VertexH &out);
+// Matrix the vertex shader takes positions to clip space with; instance_data
+// is nullptr outside drawInstanced().
+using ClipTransform = Mat4 (*)(const void *u, const void *instance_data);
 using FragmentShader = void (*)(const Fragment &in, const void *u, Vec4 &out);
+using PacketFragmentShader = void (*)(const FragmentPacket &in, const void *u, Vec4x8 &out);
 
 struct Program {
   VertexShader vs;
   FragmentShader fs;
   unsigned attr_count;
+  // Optional; shades filled triangles eight fragments at a time. Lines always
+  // go through fs.
+  PacketFragmentShader fs_packet{};
+  // Shade packets in quads, so that fs_packet can take differences between
+  // neighbouring fragments, e.g. to pick a mip level. Partly covered quads
+  // cost lanes on small triangles.
+  bool fs_quads{};
+  // Optional; takes the place of vs in drawInstanced().
+  InstanceVertexShader vs_instance{};
+  // Optional; with it, draws and instances whose vertex buffer bounds are
+  // outside the view volume are skipped before any vertex is shaded.
+  ClipTransform clip_transform{};
 };
 
 struct Triangle {
   VertexH *v[3];
+  float *attr; // Attributes of all three vertices, prepared for interpolation.
 };
 
 class Pipeline {
 public:
   enum class Culling { None, FrontFacing, BackFacing };
+  // Full shades every fragment passing the depth test. For a depth pre-pass,
+  // issue the draws with DepthOnly, which only writes depth, then repeat them
+  // with Shading, which shades the fragments matching the stored depth, i.e.
+  // every visible pixel once.
+  enum class Pass { Full, DepthOnly, Shading };
+
+  // Per rasterizer thread; entry 0 is the thread calling draw(). Each takes a
+  // cache line of its own, as threads count into them from the pixel loops.
+  struct alignas(64) ThreadStats {
+    size_t tiles{};              // Tiles rasterized.
+    size_t fragments{};          // Fragment shader invocations.
+    size_t blocks_accepted{};    // 8x8 blocks fully inside a triangle.
+    size_t blocks_rejected{};    // 8x8 blocks fully outside a triangle.
+    size_t blocks_partial{};     // 8x8 blocks, or whole small triangles, tested per pixel.
+    size_t blocks_occluded{};    // Blocks behind the farthest depth already stored.
+    size_t triangles_occluded{}; // Triangles, per tile, behind it altogether.
+    size_t depth_tests{};        // Pixels put to the early Z-test.
+    size_t depth_writes{};       // Pixels passing it in a DepthOnly pass.
+    size_t packets{};            // Fragment packets shaded.
+    double raster_ms{};          // Time spent rasterizing tiles.
+  };
 
   // Accumulated across draw() calls; reset via resetStats().
   struct Stats {
-    size_t submitted{}; // Triangles submitted to draw().
-    size_t drawn{};     // Triangles surviving clipping and culling.
-    size_t fragments{}; // Fragment shader invocations.
-    double vtx_ms{};    // Time spent in transform (vertex shading, clip, cull).
-    double raster_ms{}; // Time spent rasterizing (incl. fragment shading).
+    size_t submitted{};       // Triangles submitted to draw().
+    size_t drawn{};           // Triangles surviving clipping and culling.
+    size_t fragments{};       // Fragment shader invocations.
+    size_t packets{};         // Fragment packets shaded.
+    size_t vertices{};        // Vertex shader invocations.
+    size_t cache_hits{};      // Indices served by the post-transform vertex cache.
+    size_t clipped{};         // Triangles clipped against the near plane or guard band.
+    size_t rejected{};        // Triangles outside a frustum plane, trivially clipped.
+    size_t culled{};          // Triangles facing away, see Culling.
+    size_t degenerate{};      // Triangles with no area once snapped.
+    size_t draws_culled{};    // Draws, or instances, skipped as out of view as a whole.
+    size_t draws_reused{};    // Draws of a CommandList rasterizing cached triangles.
+    size_t blocks_accepted{}; // Summed over threads, see ThreadStats.
+    size_t blocks_rejected{};
+    size_t blocks_partial{};
+    size_t blocks_occluded{};
+    size_t triangles_occluded{};
+    size_t depth_tests{};
+    size_t depth_passed{};    // Fragments, plus the depth_writes of DepthOnly passes.
+    size_t attr_bytes{};      // Attributes interpolated, for packets' helper lanes too.
+    double vtx_ms{};          // Time spent in transform (vertex shading, clip, cull).
+    double raster_ms{};       // Time spent rasterizing (incl. fragment shading).
+    std::vector<ThreadStats> threads;
+
+    [[nodiscard]] double cacheHitRate() const {
+      auto lookups = vertices + cache_hits;
+      return lookups ? static_cast<double>(cache_hits) / lookups : 0.0;
+    }
   };
 
   void setVertexBuffer(const VertexBuffer *vb) { vb_ = vb; }
+  // Draws index triangles into the vertex buffer when set; nullptr detaches.
+  void setIndexBuffer(const IndexBuffer *ib) { ib_ = ib; }
   void setFrameBuffer(FrameBuffer *fb) { fb_ = fb; }
   auto getFrameBuffer() { return fb_; }
   void setWireframeMode(bool mode) { wireframe_ = mode; }
   void setUniform(const void *u) { uniform_ = u; }
   void setProgram(const Program *program) { prog_ = program; }
   void setCulling(Culling mode) { culling_ = mode; }
+  void setPass(Pass pass) { pass_ = pass; }
+  // Records the stages of every draw into trace; nullptr stops recording.
+  void setTrace(Trace *trace) { trace_ = trace; }
+  // With more than one thread, vertices are shaded in parallel chunks and
+  // triangles are binned into tile_size tiles that are rasterized in parallel,
+  // each tile keeping the submission order. Shaders must then be safe to call
+  // concurrently.
+  void setThreadCount(unsigned count);
+  [[nodiscard]] unsigned getThreadCount() const { return pool_ ? pool_->getThreadCount() : 1; }
   [[nodiscard]] const Stats &getStats() const { return stats_; }
   void resetStats() { stats_ = {}; }
   void draw();
+  // Draws with a program known at compile time, whose shaders are inlined into
+  // the transform and rasterizer stages instantiated for it, in place of the
+  // one set with setProgram(). Defined in raster_impl.h, which the caller
+  // includes. ProgramT provides
+  //   struct Attr;    // Attributes, floats only, at most max_attr_size; may be empty.
+  //   struct Uniform; // What setUniform() points to.
+  //   static void vs(const Vertex &in, const Uniform &u, Vec4 &pos, Attr &out);
+  //   static void fs(const Vec3 &coord, const Attr &in, const Uniform &u, Vec4 &out);
+  // and optionally static Mat4 clipTransform(const Uniform &u), see
+  // Program::clip_transform. Fragments are shaded one at a time.
+  template <class ProgramT> void draw();
+  // Draws the vertex buffer count times with the program's vs_instance, which
+  // gets instance i and instance_data + i * instance_stride. Instances are
+  // drawn in batches: the vertices of a batch are shaded in parallel chunks,
+  // and its triangles set up, binned and rasterized in one go, in instance
+  // order. The output matches count draw() calls.
+  void drawInstanced(unsigned count, const void *instance_data, size_t instance_stride);
+  // Sets the state and issues the draws recorded in list, which is left as the
+  // state afterwards. Throws std::invalid_argument with the message of
+  // list.validate(), before drawing anything, if the list is invalid.
+  void replay(CommandList &list);
 
   constexpr static unsigned max_attr_size{16}; // In floats.
+  constexpr static unsigned tile_size{64};     // In pixels.
+  static_assert(std::size(FragmentPacket{}.attr) == max_attr_size);
 
 private:
-  std::vector<Triangle> transform();
+  // Times the rasterizer stages one by one, see bench/renderer_bench.cc.
+  friend struct PipelineBench;
+  friend class CommandList;
+
+  // Fragments that passed early Z, waiting to be shaded as one packet.
+  struct PacketQueue {
+    alignas(32) float x[8];
+    alignas(32) float y[8];
+    alignas(32) float z[8];
+    alignas(32) float w[3][8]; // Barycentric weights.
+    unsigned mask;
+    unsigned count; // Lanes in use, including helpers.
+  };
+
+  // Vertex created by clipping, with room for the attributes.
+  struct alignas(32) ClippedVertex {
+    float attr[max_attr_size];
+    VertexH vert;
+  };
+
+  // Output of one transform job. Triangles may point into clipped.
+  struct TransformChunk {
+    std::vector<Triangle> triangles;
+    std::deque<ClippedVertex> clipped;
+    size_t clipped_count;
+    size_t rejected_count;
+  };
+
+  // Output of transform() for one draw of a CommandList, kept for the next
+  // replay along with the arenas and chunks its triangles point into.
+  struct TransformCache {
+    uint64_t key{};
+    bool valid{};
+    Arena vert_arena;
+    Arena attr_arena;
+    std::vector<TransformChunk> chunks;
+    std::vector<Triangle> triangles;
+    size_t clipped{};
+    size_t rejected{};
+  };
+
+  // Inclusive pixel rectangle a rasterizer call may write to.
+  struct Tile {
+    int x0, y0, x1, y1;
+    ThreadStats *stats;
+  };
+
+  // Transform and rasterizer stages specialized on the wireframe mode, the
+  // culling mode and the number of 8-float attribute vectors, so that their
+  // inner loops do not branch on them. Picked once per draw by getVariant().
+  struct Variant {
+    std::vector<Triangle> (Pipeline::*transform)();
+    void (Pipeline::*rasterize)(std::vector<Triangle> &triangles);
+    bool (Pipeline::*setup_triangle)(Triangle &tri);
+    void (Pipeline::*rasterize_triangle)(const Triangle &tri, const Tile &tile);
+    void (Pipeline::*fill)(const Triangle &tri, float x, float y, float w0, float w1, float w2,
+                           const Tile &tile);
+  };
+
+  // How the transform and rasterizer stages invoke the shaders: through the
+  // program's pointers, or straight into a ProgramT of draw<ProgramT>().
+  struct DynamicShading {
+    constexpr static bool packets{true};
+    static void shadeVertex(const Pipeline &p, const char *in, size_t instance, VertexH &out) {
+      auto &vertex = *reinterpret_cast<const Vertex *>(in);
+      if (p.instanced_) {
+        auto id = p.instances_[p.instance_first_ + instance];
+        auto data = p.instance_data_ ? p.instance_data_ + id * p.instance_stride_ : nullptr;
+        p.prog_->vs_instance(vertex, p.uniform_, id, data, out);
+      } else {
+        p.prog_->vs(vertex, p.uniform_, out);
+      }
+    }
+    static void shade(const Pipeline &p, const Fragment &in, Vec4 &out) {
+      p.prog_->fs(in, p.uniform_, out);
+    }
+  };
+  template <class ProgramT> struct StaticShading {
+    using Attr = typename ProgramT::Attr;
+    using Uniform = typename ProgramT::Uniform;
+
+    constexpr static bool packets{false};
+    static void shadeVertex(const Pipeline &p, const char *in, size_t, VertexH &out) {
+      // out.attr has no storage behind it without attributes.
+      Attr none;
+      auto &attr = std::is_empty_v<Attr> ? none : *static_cast<Attr *>(out.attr);
+      ProgramT::vs(*reinterpret_cast<const Vertex *>(in), *static_cast<const Uniform *>(p.uniform_),
+                   out.pos, attr);
+    }
+    static void shade(const Pipeline &p, const Fragment &in, Vec4 &out) {
+      ProgramT::fs(in.coord, *static_cast<const Attr *>(in.attr),
+                   *static_cast<const Uniform *>(p.uniform_), out);
+    }
+  };
+
+  constexpr static unsigned culling_modes{3};
+  constexpr static unsigned attr_vec_counts{max_attr_size / 8 + 1};
+  using Variants = std::array<Variant, 2 * culling_modes * attr_vec_counts>;
+
+  bool isOutOfView(const void *instance_data) const;
+  // Counts the current draw as culled if it is out of view.
+  bool cullDraw();
+  // Draws the current batch; with cache, reuses its triangles if key matches,
+  // or else fills it.
+  void execute(TransformCache *cache = nullptr, uint64_t key = 0);
+  uint64_t transformKey(const void *uniform, size_t uniform_size) const;
+  template <class Shading> std::vector<Triangle> transform();
+  template <class Shading> void transformRange(size_t first, size_t last, TransformChunk &out);
+  template <class Shading> void shadeIndexed(size_t index_count);
+  void assembleIndexed(size_t first, size_t last, TransformChunk &out);
+  void clipTriangle(VertexH *const (&verts)[3], const Vec4 (&pos)[3], uint16_t codes,
+                    TransformChunk &out) const;
+  void project(VertexH &vert) const;
+  template <bool Wireframe, Culling Cull, unsigned AttrVecs, class Shading>
+  constexpr static Variant makeVariant();
+  template <class Shading> static const Variants &getVariants();
+  [[nodiscard]] const Variant &getVariant() const;
+  template <bool Wireframe, Culling Cull, unsigned AttrVecs, class Shading>
   void rasterize(std::vector<Triangle> &triangles);
-  void rasterizeLine(const VertexH &v0, const VertexH &v1);
-  void rasterizeTriHalfSpace(Triangle &tri);
-  void fill(const VertexH &v1, const VertexH &v2, float x, float y, float w);
-  void fill(const Triangle &tri, float x, float y, float w0, float w1, float w2);
-  void invokeFragmentShader(const Fragment &frag);
+  template <bool Wireframe, unsigned AttrVecs, class Shading>
+  void rasterizeTiles(const std::vector<Triangle> &triangles);
+  template <bool Wireframe, Culling Cull> bool setupTriangle(Triangle &tri);
+  template <bool Wireframe, unsigned AttrVecs, class Shading>
+  void rasterizeTriangle(const Triangle &tri, const Tile &tile);
+  template <class Shading>
+  void rasterizeLine(const VertexH &v0, const VertexH &v1, const Tile &tile);
+  template <unsigned AttrVecs, class Shading>
+  void rasterizeTriHalfSpace(const Triangle &tri, const Tile &tile);
+  template <class Shading>
+  void fill(const VertexH &v1, const VertexH &v2, float x, float y, float w, const Tile &tile);
+  template <unsigned AttrVecs, class Shading>
+  void fill(const Triangle &tri, float x, float y, float w0, float w1, float w2,
+            const Tile &tile);
+  void gather(PacketQueue &queue, const Triangle &tri, float x, float y, float w0, float w1,
+              float w2, const Tile &tile);
+  void gatherQuad(PacketQueue &queue, const Triangle &tri, int x, int y, unsigned mask,
+                  const float (&w0)[4], const float (&w1)[4], const Tile &tile);
+  void shadePacket(PacketQueue &queue, const Triangle &tri, const Tile &tile);
+  bool earlyDepthTest(float z, unsigned x, unsigned y, ThreadStats &stats);
+  void sumThreadStats();
+  template <class Shading> void invokeFragmentShader(const Fragment &frag, const Tile &tile);
 
   Arena vert_arena_;
   Arena attr_arena_;
+  Arena tri_attr_arena_;
   const VertexBuffer *vb_{nullptr};
+  const IndexBuffer *ib_{nullptr};
   FrameBuffer *fb_{nullptr};
   const Program *prog_;
+  const Variants *variants_{nullptr}; // Of draw<ProgramT>(), or else the dynamic ones.
   const void *uniform_{nullptr};
   Culling culling_{Culling::None};
+  Pass pass_{Pass::Full};
   bool wireframe_{false};
+  // Batch in progress of drawInstanced(), entries [instance_first_,
+  // instance_first_ + instance_count_) of instances_; draw() is a single
+  // instance shaded by vs.
+  size_t instance_first_{};
+  size_t instance_count_{1};
+  const char *instance_data_{nullptr};
+  size_t instance_stride_{};
+  bool instanced_{false};
+  std::vector<unsigned> instances_; // Of drawInstanced(), left after culling.
   Stats stats_;
+  Trace *trace_{nullptr};
+  std::unique_ptr<ThreadPool> pool_;
+  std::vector<std::vector<unsigned>> bins_;
+  std::vector<unsigned> active_tiles_;
+  std::vector<TransformChunk> chunks_;
+  std::vector<uint16_t> vert_flags_;
+  std::vector<Vec4> clip_pos_;
+  float guard_x_{1.f};
+  float guard_y_{1.f};
+  std::vector<unsigned> cached_;
 };
 
 } // namespace renderer
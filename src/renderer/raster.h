@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "renderer/pipeline.h"
+
+// Fixed-point triangle setup of the rasterizer, in a header of its own so that
+// the benchmarks can time it.
+namespace renderer::detail {
+
+// 8 bit sub pixel precision.
+constexpr auto prec_bits = 8;
+constexpr auto prec_step = 1 << prec_bits;
+constexpr auto prec_mask = ~(prec_step - 1);
+constexpr auto prec_offset = (prec_step - 1) >> 1;
+
+struct Edge {
+  int eq;
+  int step_x;
+  int step_y;
+};
+
+// Vertex positions snapped to the sub pixel grid and twice the signed area in
+// sub pixel units.
+struct SnappedTriangle {
+  int x0, y0, x1, y1, x2, y2;
+  int area;
+};
+
+inline SnappedTriangle snap(const Triangle &tri) {
+  constexpr auto scale = static_cast<float>(prec_step);
+
+  SnappedTriangle s;
+  s.x0 = tri.v[0]->pos.x * scale;
+  s.x1 = tri.v[1]->pos.x * scale;
+  s.x2 = tri.v[2]->pos.x * scale;
+  s.y0 = tri.v[0]->pos.y * scale;
+  s.y1 = tri.v[1]->pos.y * scale;
+  s.y2 = tri.v[2]->pos.y * scale;
+  s.area = (static_cast<long long>(s.x1 - s.x0) * (s.y2 - s.y0) -
+            static_cast<long long>(s.y1 - s.y0) * (s.x2 - s.x0)) >>
+           prec_bits;
+  return s;
+}
+
+inline Edge setup_edge(int x1, int y1, int x2, int y2, int x_start, int y_start, int prec) {
+  auto dx = x2 - x1;
+  auto dy = y2 - y1;
+  auto bias = dy < 0 || (dy == 0 && dx < 0) ? 0 : -1;
+
+  int e = (static_cast<long long>(dx) * (y_start - y2) -
+           static_cast<long long>(dy) * (x_start - x2) + bias) >>
+          prec;
+  return {.eq = e, .step_x = dy, .step_y = dx};
+}
+
+// Size of one vertex' attribute block, padded to whole AVX registers.
+inline unsigned attrBlockSize(unsigned attr_count) { return (attr_count + 7) / 8 * 32; }
+
+// Writes the vertex attributes to tri.attr premultiplied by 1/w and relative to
+// the first vertex, so that fill() only needs a0 + a1 * w1 + a2 * w2. Vertices
+// may be shared between triangles, hence the separate storage.
+inline void precomputeAttrs(const Triangle &tri, unsigned attr_count) {
+  if (!attr_count)
+    return;
+
+  const float *in[] = {reinterpret_cast<const float *>(tri.v[0]->attr),
+                       reinterpret_cast<const float *>(tri.v[1]->attr),
+                       reinterpret_cast<const float *>(tri.v[2]->attr)};
+  auto stride = attrBlockSize(attr_count) / sizeof(float);
+  float *out[] = {tri.attr, tri.attr + stride, tri.attr + 2 * stride};
+
+#ifdef __AVX__
+  auto w0 = _mm256_broadcast_ss(&tri.v[0]->pos.w);
+  auto w1 = _mm256_broadcast_ss(&tri.v[1]->pos.w);
+  auto w2 = _mm256_broadcast_ss(&tri.v[2]->pos.w);
+
+  auto vecs = (attr_count + 7) / 8;
+  for (auto i = 0u; i < vecs; ++i) {
+    auto in0 = _mm256_load_ps(in[0] + i * 8);
+    auto in1 = _mm256_load_ps(in[1] + i * 8);
+    auto in2 = _mm256_load_ps(in[2] + i * 8);
+    auto attr0 = _mm256_mul_ps(in0, w0);
+    _mm256_store_ps(out[1] + i * 8, _mm256_sub_ps(_mm256_mul_ps(in1, w1), attr0));
+    _mm256_store_ps(out[2] + i * 8, _mm256_sub_ps(_mm256_mul_ps(in2, w2), attr0));
+    _mm256_store_ps(out[0] + i * 8, attr0);
+  }
+#else
+  auto w0 = tri.v[0]->pos.w;
+  auto w1 = tri.v[1]->pos.w;
+  auto w2 = tri.v[2]->pos.w;
+
+  for (auto i = 0u; i < attr_count; ++i) {
+    auto attr0 = in[0][i] * w0;
+    out[1][i] = in[1][i] * w1 - attr0;
+    out[2][i] = in[2][i] * w2 - attr0;
+    out[0][i] = attr0;
+  }
+#endif
+}
+
+struct PixelBounds {
+  int x0, y0, x1, y1;
+};
+
+// Pixels the triangle may cover, unclamped. Lines snap the way rasterizeLine()
+// does, filled triangles the way rasterizeTriHalfSpace() does.
+inline PixelBounds pixelBounds(const Triangle &tri, bool lines) {
+  if (lines) {
+    int x[] = {static_cast<int>(tri.v[0]->pos.x), static_cast<int>(tri.v[1]->pos.x),
+               static_cast<int>(tri.v[2]->pos.x)};
+    int y[] = {static_cast<int>(tri.v[0]->pos.y), static_cast<int>(tri.v[1]->pos.y),
+               static_cast<int>(tri.v[2]->pos.y)};
+    auto [x_min, x_max] = std::minmax({x[0], x[1], x[2]});
+    auto [y_min, y_max] = std::minmax({y[0], y[1], y[2]});
+    return {x_min, y_min, x_max, y_max};
+  }
+
+  auto s = snap(tri);
+  auto [x_min, x_max] = std::minmax({s.x0, s.x1, s.x2});
+  auto [y_min, y_max] = std::minmax({s.y0, s.y1, s.y2});
+  return {x_min >> prec_bits, y_min >> prec_bits, x_max >> prec_bits, y_max >> prec_bits};
+}
+
+inline float lerp(float a, float b, float w) { return (1.f - w) * a + w * b; }
+
+} // namespace renderer::detail
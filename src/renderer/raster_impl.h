@@ -0,0 +1,823 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "renderer/pipeline.h"
+#include "renderer/raster.h"
+
+// The transform and rasterizer stages, which are templates on how the shaders
+// are called. Only pipeline.cc, which instantiates them for Program, and the
+// callers of Pipeline::draw<ProgramT>(), which instantiate them with the
+// program's shaders inlined, include this.
+namespace renderer::detail {
+
+// Triangles per parallel transform job.
+constexpr auto transform_chunk = 1024uz;
+
+// Clip codes. A triangle whose vertices share a frustum code is rejected, one
+// with a vertex behind the near plane or past the guard band is clipped.
+constexpr uint16_t clip_left = 1 << 0;
+constexpr uint16_t clip_right = 1 << 1;
+constexpr uint16_t clip_bottom = 1 << 2;
+constexpr uint16_t clip_top = 1 << 3;
+constexpr uint16_t clip_near = 1 << 4;
+constexpr uint16_t clip_far = 1 << 5;
+constexpr uint16_t guard_left = 1 << 6;
+constexpr uint16_t guard_right = 1 << 7;
+constexpr uint16_t guard_bottom = 1 << 8;
+constexpr uint16_t guard_top = 1 << 9;
+constexpr uint16_t frustum_codes = clip_left | clip_right | clip_bottom | clip_top | clip_near |
+                                   clip_far;
+constexpr uint16_t clipping_codes = clip_near | guard_left | guard_right | guard_bottom |
+                                    guard_top;
+
+// Per-vertex state of the post-transform cache, stored next to the clip codes.
+constexpr uint16_t vertex_referenced = 1 << 10;
+
+// The guard band spans [-guard_x, guard_x] in NDC horizontally, likewise
+// vertically.
+inline uint16_t clipCode(const Vec4 &pos, float guard_x, float guard_y) {
+  uint16_t code = 0;
+  if (pos.x < -pos.w)
+    code |= clip_left;
+  if (pos.x > pos.w)
+    code |= clip_right;
+  if (pos.y < -pos.w)
+    code |= clip_bottom;
+  if (pos.y > pos.w)
+    code |= clip_top;
+  if (pos.z < -pos.w)
+    code |= clip_near;
+  if (pos.z > pos.w)
+    code |= clip_far;
+  if (pos.x < -guard_x * pos.w)
+    code |= guard_left;
+  if (pos.x > guard_x * pos.w)
+    code |= guard_right;
+  if (pos.y < -guard_y * pos.w)
+    code |= guard_bottom;
+  if (pos.y > guard_y * pos.w)
+    code |= guard_top;
+  return code;
+}
+
+// Calls fn with a typed pointer to the indices.
+template <class F> void withIndices(const IndexBuffer &ib, F fn) {
+  if (ib.type == IndexBuffer::Type::U16)
+    fn(static_cast<const uint16_t *>(ib.ptr));
+  else
+    fn(static_cast<const uint32_t *>(ib.ptr));
+}
+
+} // namespace renderer::detail
+
+namespace renderer {
+
+template <bool Wireframe, Pipeline::Culling Cull, unsigned AttrVecs, class Shading>
+constexpr Pipeline::Variant Pipeline::makeVariant() {
+  return {.transform = &Pipeline::transform<Shading>,
+          .rasterize = &Pipeline::rasterize<Wireframe, Cull, AttrVecs, Shading>,
+          .setup_triangle = &Pipeline::setupTriangle<Wireframe, Cull>,
+          .rasterize_triangle = &Pipeline::rasterizeTriangle<Wireframe, AttrVecs, Shading>,
+          .fill = &Pipeline::fill<AttrVecs, Shading>};
+}
+
+// Every combination of wireframe mode, culling mode and count of attribute
+// vectors, indexed in that order.
+template <class Shading> const Pipeline::Variants &Pipeline::getVariants() {
+  constexpr static auto variants = []<unsigned... I>(std::integer_sequence<unsigned, I...>) {
+    return Variants{makeVariant<I / (culling_modes * attr_vec_counts) != 0,
+                                static_cast<Culling>(I / attr_vec_counts % culling_modes),
+                                I % attr_vec_counts, Shading>()...};
+  }(std::make_integer_sequence<unsigned, std::tuple_size_v<Variants>>{});
+  return variants;
+}
+
+template <class ProgramT> void Pipeline::draw() {
+  using Attr = typename ProgramT::Attr;
+  using Uniform = typename ProgramT::Uniform;
+  constexpr auto attr_count = std::is_empty_v<Attr> ? 0u : sizeof(Attr) / sizeof(float);
+  static_assert(std::is_trivially_copyable_v<Attr> && alignof(Attr) <= alignof(float));
+  static_assert(std::is_empty_v<Attr> || sizeof(Attr) % sizeof(float) == 0);
+  static_assert(attr_count <= max_attr_size);
+
+  // What the stages read of the program besides the shaders, which
+  // StaticShading<ProgramT> calls directly.
+  constexpr static Program program{
+      .vs = nullptr,
+      .fs = nullptr,
+      .attr_count = attr_count,
+      .clip_transform = [] {
+        if constexpr (requires(const Uniform &u) { ProgramT::clipTransform(u); })
+          return +[](const void *u, const void *) {
+            return ProgramT::clipTransform(*static_cast<const Uniform *>(u));
+          };
+        else
+          return ClipTransform{};
+      }()};
+
+  auto prog = prog_;
+  prog_ = &program;
+  variants_ = &getVariants<StaticShading<ProgramT>>();
+  draw();
+  prog_ = prog;
+  variants_ = nullptr;
+}
+
+template <class Shading> std::vector<Triangle> Pipeline::transform() {
+  using namespace detail;
+
+  Trace::Scope scope{trace_, "transform"};
+  // Triangles are numbered across instances, those of instance i following
+  // those of instance i - 1.
+  auto instance_tris = (ib_ ? ib_->count : vb_->count) / 3;
+  auto tri_count = instance_tris * instance_count_;
+
+  if (ib_)
+    shadeIndexed<Shading>(instance_tris * 3);
+  else
+    stats_.vertices += tri_count * 3;
+  if (!tri_count)
+    return {};
+
+  auto assemble = [&](size_t first, size_t last, TransformChunk &chunk) {
+    chunk.triangles.clear();
+    chunk.clipped.clear();
+    chunk.clipped_count = 0;
+    chunk.rejected_count = 0;
+    if (ib_)
+      assembleIndexed(first, last, chunk);
+    else
+      transformRange<Shading>(first, last, chunk);
+  };
+
+  // Small draws are not worth handing off to the pool.
+  if (!pool_ || tri_count < 2 * transform_chunk) {
+    chunks_.resize(1);
+    chunks_[0].triangles.reserve(tri_count);
+    assemble(0, tri_count, chunks_[0]);
+    stats_.clipped += chunks_[0].clipped_count;
+    stats_.rejected += chunks_[0].rejected_count;
+    return std::move(chunks_[0].triangles);
+  }
+
+  // Every triangle owns a fixed slice of the arenas, so chunks can be shaded
+  // independently and then joined in the original order.
+  chunks_.resize((tri_count + transform_chunk - 1) / transform_chunk);
+  pool_->run(chunks_.size(), [&](size_t chunk, unsigned) {
+    auto first = chunk * transform_chunk;
+    assemble(first, std::min(first + transform_chunk, tri_count), chunks_[chunk]);
+  });
+
+  auto total = 0uz;
+  for (auto &chunk : chunks_)
+    total += chunk.triangles.size();
+  std::vector<Triangle> out;
+  out.reserve(total);
+  for (auto &chunk : chunks_) {
+    out.insert(out.end(), chunk.triangles.begin(), chunk.triangles.end());
+    stats_.clipped += chunk.clipped_count;
+    stats_.rejected += chunk.rejected_count;
+  }
+
+  return out;
+}
+
+// Shades, clips and maps to the screen triangles [first, last).
+template <class Shading>
+void Pipeline::transformRange(size_t first, size_t last, TransformChunk &out) {
+  using namespace detail;
+
+  auto instance_tris = vb_->count / 3;
+  auto instance = first / instance_tris;
+  auto begin = static_cast<const char *>(vb_->ptr);
+  auto end = begin + instance_tris * 3 * vb_->stride;
+  auto buf = begin + (first - instance * instance_tris) * 3 * vb_->stride;
+
+  for (auto i = first; i < last; ++i) {
+    if (buf == end) {
+      buf = begin;
+      ++instance;
+    }
+    VertexH *verts[3];
+    Vec4 pos[3];
+    uint16_t codes[3];
+    for (auto j = 0u; j < 3; ++j) {
+      auto v = verts[j] = vert_arena_.at<VertexH>(i * 3 + j);
+      v->attr = attr_arena_.at<void>(i * 3 + j);
+      Shading::shadeVertex(*this, buf, instance, *v);
+      pos[j] = v->pos;
+      codes[j] = clipCode(v->pos, guard_x_, guard_y_);
+      buf += vb_->stride;
+    }
+
+    if (codes[0] & codes[1] & codes[2] & frustum_codes) {
+      ++out.rejected_count;
+      continue;
+    }
+
+    for (auto vert : verts)
+      project(*vert);
+
+    auto codes_any = static_cast<uint16_t>(codes[0] | codes[1] | codes[2]);
+    if (codes_any & clipping_codes)
+      clipTriangle(verts, pos, codes_any, out);
+    else
+      out.triangles.push_back({{verts[0], verts[1], verts[2]}, nullptr});
+  }
+}
+
+// Post-transform vertex cache: every vertex referenced by the first
+// index_count indices is shaded once per instance, into the vert_arena_ slot of
+// its index plus instance * vb_->count.
+template <class Shading> void Pipeline::shadeIndexed(size_t index_count) {
+  using namespace detail;
+
+  Trace::Scope scope{trace_, "shade vertices"};
+  vert_flags_.assign(vb_->count * instance_count_, 0);
+  clip_pos_.resize(vb_->count * instance_count_);
+  cached_.clear();
+  withIndices(*ib_, [&](auto indices) {
+    for (auto i = 0uz; i < index_count; ++i) {
+      auto index = indices[i];
+      assert(index < vb_->count);
+      if (!vert_flags_[index]) {
+        vert_flags_[index] = vertex_referenced;
+        cached_.push_back(index);
+      }
+    }
+  });
+  stats_.vertices += cached_.size() * instance_count_;
+  stats_.cache_hits += (index_count - cached_.size()) * instance_count_;
+
+  // Shades entries [first, last) of cached_ repeated for every instance.
+  auto shade = [&](size_t first, size_t last) {
+    auto buf = static_cast<const char *>(vb_->ptr);
+    auto instance = first / cached_.size();
+    auto i = first - instance * cached_.size();
+    for (auto entry = first; entry < last; ++entry, ++i) {
+      if (i == cached_.size()) {
+        i = 0;
+        ++instance;
+      }
+      auto index = cached_[i];
+      auto slot = instance * vb_->count + index;
+      auto &v = *vert_arena_.at<VertexH>(slot);
+      v.attr = attr_arena_.at<void>(slot);
+      Shading::shadeVertex(*this, buf + index * vb_->stride, instance, v);
+      vert_flags_[slot] |= clipCode(v.pos, guard_x_, guard_y_);
+      clip_pos_[slot] = v.pos;
+      project(v);
+    }
+  };
+
+  auto total = cached_.size() * instance_count_;
+  if (!total)
+    return;
+  if (!pool_ || total < 2 * transform_chunk * 3) {
+    shade(0, total);
+    return;
+  }
+  auto chunk_size = transform_chunk * 3;
+  pool_->run((total + chunk_size - 1) / chunk_size, [&](size_t chunk, unsigned) {
+    auto first = chunk * chunk_size;
+    shade(first, std::min(first + chunk_size, total));
+  });
+}
+
+template <bool Wireframe, Pipeline::Culling Cull, unsigned AttrVecs, class Shading>
+void Pipeline::rasterize(std::vector<Triangle> &triangles) {
+  // Set triangles up once, so that every tile they are binned into shares it.
+  {
+    Trace::Scope scope{trace_, "setup"};
+    tri_attr_arena_.reset(triangles.size(), 3 * detail::attrBlockSize(prog_->attr_count), 32);
+    auto kept = 0uz;
+    for (auto &tri : triangles) {
+      tri.attr = tri_attr_arena_.at<float>(kept);
+      if (setupTriangle<Wireframe, Cull>(tri))
+        triangles[kept++] = tri;
+    }
+    triangles.resize(kept);
+  }
+
+  if (pool_) {
+    rasterizeTiles<Wireframe, AttrVecs, Shading>(triangles);
+    return;
+  }
+
+  Trace::Scope scope{trace_, "raster"};
+
+  auto &stats = stats_.threads[0];
+  Tile screen{.x0 = 0,
+              .y0 = 0,
+              .x1 = static_cast<int>(fb_->getWidth()) - 1,
+              .y1 = static_cast<int>(fb_->getHeight()) - 1,
+              .stats = &stats};
+  auto t0 = std::chrono::steady_clock::now();
+  for (auto &tri : triangles)
+    rasterizeTriangle<Wireframe, AttrVecs, Shading>(tri, screen);
+  auto t1 = std::chrono::steady_clock::now();
+  ++stats.tiles;
+  stats.raster_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+// Sort-middle: bin triangles into screen tiles, then rasterize the tiles in
+// parallel. A tile is only ever touched by one thread and sees its triangles in
+// submission order, so the output matches the serial path.
+template <bool Wireframe, unsigned AttrVecs, class Shading>
+void Pipeline::rasterizeTiles(const std::vector<Triangle> &triangles) {
+  constexpr int size = tile_size;
+  int width = fb_->getWidth();
+  int height = fb_->getHeight();
+  auto tiles_x = (width + size - 1) / size;
+  auto tiles_y = (height + size - 1) / size;
+
+  {
+    Trace::Scope scope{trace_, "bin"};
+    bins_.resize(static_cast<size_t>(tiles_x) * tiles_y);
+    for (auto &bin : bins_)
+      bin.clear();
+
+    for (auto i = 0u; i < triangles.size(); ++i) {
+      auto bounds = detail::pixelBounds(triangles[i], Wireframe);
+      auto x0 = std::max(bounds.x0, 0);
+      auto y0 = std::max(bounds.y0, 0);
+      auto x1 = std::min(bounds.x1, width - 1);
+      auto y1 = std::min(bounds.y1, height - 1);
+      if (x0 > x1 || y0 > y1)
+        continue;
+
+      for (auto ty = y0 / size; ty <= y1 / size; ++ty)
+        for (auto tx = x0 / size; tx <= x1 / size; ++tx)
+          bins_[ty * tiles_x + tx].push_back(i);
+    }
+
+    active_tiles_.clear();
+    for (auto i = 0u; i < bins_.size(); ++i) {
+      if (!bins_[i].empty())
+        active_tiles_.push_back(i);
+    }
+  }
+
+  Trace::Scope scope{trace_, "raster"};
+  pool_->run(active_tiles_.size(), [&](size_t item, unsigned thread) {
+    auto idx = active_tiles_[item];
+    int x0 = idx % tiles_x * size;
+    int y0 = idx / tiles_x * size;
+    Tile tile{.x0 = x0,
+              .y0 = y0,
+              .x1 = std::min(x0 + size, width) - 1,
+              .y1 = std::min(y0 + size, height) - 1,
+              .stats = &stats_.threads[thread]};
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (auto i : bins_[idx])
+      rasterizeTriangle<Wireframe, AttrVecs, Shading>(triangles[i], tile);
+    auto t1 = std::chrono::steady_clock::now();
+    ++tile.stats->tiles;
+    tile.stats->raster_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+  });
+}
+
+// Culls the triangle and does the per-triangle work shared by all tiles.
+// Returns false if there is nothing to rasterize.
+template <bool Wireframe, Pipeline::Culling Cull> bool Pipeline::setupTriangle(Triangle &tri) {
+  if constexpr (Wireframe) {
+    // TODO: Deal with the duplication of the area calculation.
+    auto area = (tri.v[1]->pos.x - tri.v[0]->pos.x) * (tri.v[2]->pos.y - tri.v[0]->pos.y) -
+                (tri.v[2]->pos.x - tri.v[0]->pos.x) * (tri.v[1]->pos.y - tri.v[0]->pos.y);
+    // Reject degenerate triangles like the half-space path does, so
+    // stats_.drawn means the same thing in both modes.
+    if (area == 0.f) {
+      ++stats_.degenerate;
+      return false;
+    }
+    if ((Cull == Culling::BackFacing && area < 0.f) ||
+        (Cull == Culling::FrontFacing && area > 0.f)) {
+      ++stats_.culled;
+      return false;
+    }
+    ++stats_.drawn;
+    return true;
+  } else {
+    auto area = detail::snap(tri).area;
+    if (area == 0) {
+      ++stats_.degenerate;
+      return false;
+    }
+    if ((Cull == Culling::BackFacing && area < 0) || (Cull == Culling::FrontFacing && area > 0)) {
+      ++stats_.culled;
+      return false;
+    }
+    if (area < 0)
+      std::swap(tri.v[1], tri.v[2]);
+    ++stats_.drawn;
+
+    if (pass_ != Pass::DepthOnly)
+      detail::precomputeAttrs(tri, prog_->attr_count);
+    return true;
+  }
+}
+
+template <bool Wireframe, unsigned AttrVecs, class Shading>
+void Pipeline::rasterizeTriangle(const Triangle &tri, const Tile &tile) {
+  if constexpr (Wireframe) {
+    rasterizeLine<Shading>(*tri.v[0], *tri.v[1], tile);
+    rasterizeLine<Shading>(*tri.v[0], *tri.v[2], tile);
+    rasterizeLine<Shading>(*tri.v[1], *tri.v[2], tile);
+  } else {
+    rasterizeTriHalfSpace<AttrVecs, Shading>(tri, tile);
+  }
+}
+
+// Bresenham's line algorithm.
+template <class Shading>
+void Pipeline::rasterizeLine(const VertexH &v0, const VertexH &v1, const Tile &tile) {
+  int x0 = v0.pos.x;
+  int x1 = v1.pos.x;
+  int y0 = v0.pos.y;
+  int y1 = v1.pos.y;
+  auto from = &v0;
+  auto to = &v1;
+  auto steep = false;
+  if (std::abs(y1 - y0) > std::abs(x1 - x0)) {
+    steep = true;
+    std::swap(x0, y0);
+    std::swap(x1, y1);
+  }
+  if (x0 > x1) {
+    std::swap(from, to);
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+  }
+
+  int y = y0;
+  int dx = x1 - x0;
+  int dy = std::abs(y1 - y0);
+  auto diff = 2 * dy - dx;
+  int y_growth = y1 > y0 ? 1 : -1;
+  auto w_step = 1.f / dx;
+  auto w = 0.f;
+
+  if (steep)
+    fill<Shading>(*from, *to, y0, x0, w, tile);
+  else
+    fill<Shading>(*from, *to, x0, y0, w, tile);
+
+  if (diff > 0) {
+    y += y_growth;
+    diff -= 2 * dx;
+  }
+  for (int x = x0 + 1; x <= x1; ++x) {
+    w += w_step;
+    if (steep)
+      fill<Shading>(*from, *to, y, x, w, tile);
+    else
+      fill<Shading>(*from, *to, x, y, w, tile);
+
+    diff += 2 * dy;
+    if (diff > 0) {
+      y += y_growth;
+      diff -= 2 * dx;
+    }
+  }
+}
+
+// Top-left filling convention. Expects a triangle that went through
+// setupTriangle(), i.e. with counter-clockwise winding and non-zero area.
+template <unsigned AttrVecs, class Shading>
+void Pipeline::rasterizeTriHalfSpace(const Triangle &tri, const Tile &tile) {
+  using namespace detail;
+
+  auto [x0, y0, x1, y1, x2, y2, area] = snap(tri);
+  auto area_rec = 1.f / area;
+
+  auto aabb_x = std::minmax({x0, x1, x2});
+  auto aabb_y = std::minmax({y0, y1, y2});
+  aabb_x = {std::max(tile.x0 << prec_bits, aabb_x.first),
+            std::min(tile.x1 << prec_bits, aabb_x.second)};
+  aabb_y = {std::max(tile.y0 << prec_bits, aabb_y.first),
+            std::min(tile.y1 << prec_bits, aabb_y.second)};
+
+  auto x_start = (aabb_x.first & prec_mask) + prec_offset;
+  auto y_start = (aabb_y.first & prec_mask) + prec_offset;
+  auto x_end = (aabb_x.second & prec_mask) + prec_offset;
+  auto y_end = (aabb_y.second & prec_mask) + prec_offset;
+
+  auto x_first = x_start >> prec_bits;
+  auto y_first = y_start >> prec_bits;
+  x_end >>= prec_bits;
+  y_end >>= prec_bits;
+  if (x_first > x_end || y_first > y_end)
+    return;
+
+  // Hierarchical depth test: the depth interpolated across the triangle is
+  // never nearer than its nearest vertex, so if that lies behind the farthest
+  // depth stored under the triangle's part of the tile, every fragment would
+  // fail the early Z-test. Rounding to the depth format keeps that true.
+  auto &stats = *tile.stats;
+  auto z_min = fb_->quantizeDepth(std::min({tri.v[0]->pos.z, tri.v[1]->pos.z, tri.v[2]->pos.z}));
+  auto occluded = [&](float max_depth) {
+    return pass_ == Pass::Shading ? z_min > max_depth : z_min >= max_depth;
+  };
+  if (occluded(fb_->getMaxDepth(x_first, y_first, x_end, y_end))) {
+    ++stats.triangles_occluded;
+    return;
+  }
+
+  auto edge0 = setup_edge(x1, y1, x2, y2, x_start, y_start, prec_bits);
+  auto edge1 = setup_edge(x2, y2, x0, y0, x_start, y_start, prec_bits);
+  auto edge2 = setup_edge(x0, y0, x1, y1, x_start, y_start, prec_bits);
+
+  // Shades the covered pixels of the 4x2 stamp at (x, y), given the first two
+  // edge functions at all eight pixels. Lanes 0-3 are the lower row. Quad
+  // shading splits the stamp into two quads, which keep their uncovered pixels
+  // as helpers.
+  auto packets = Shading::packets && prog_->fs_packet != nullptr;
+  PacketQueue queue;
+  queue.mask = 0;
+  queue.count = 0;
+  auto shade_stamp = [&](int x, int y, unsigned covered, const int *e0, const int *e1) {
+    stats.depth_tests += std::popcount(covered);
+    if (!packets || !prog_->fs_quads) {
+      for (; covered; covered &= covered - 1) {
+        auto lane = std::countr_zero(covered);
+        auto w0 = e0[lane] * area_rec;
+        auto w1 = e1[lane] * area_rec;
+        auto w2 = 1 - w0 - w1;
+
+        if (packets)
+          gather(queue, tri, x + (lane & 3), y + (lane >> 2), w0, w1, w2, tile);
+        else
+          fill<AttrVecs, Shading>(tri, x + (lane & 3), y + (lane >> 2), w0, w1, w2, tile);
+      }
+      return;
+    }
+
+    for (auto q = 0; q < 2; ++q) {
+      auto mask = (covered >> 2 * q & 3) | (covered >> (4 + 2 * q) & 3) << 2;
+      if (!mask)
+        continue;
+      float w0[4];
+      float w1[4];
+      for (auto i = 0; i < 4; ++i) {
+        auto lane = 2 * q + (i & 1) + (i >> 1) * 4;
+        w0[i] = e0[lane] * area_rec;
+        w1[i] = e1[lane] * area_rec;
+      }
+      gatherQuad(queue, tri, x + 2 * q, y, mask, w0, w1, tile);
+    }
+  };
+
+  // Walk 8x8 blocks aligned to the block grid. An edge function is linear, so
+  // its extremes over a block are at the block's corners: a block with all
+  // corners outside one edge is skipped, one with all corners inside every
+  // edge is filled without per-pixel tests, the rest are tested per pixel.
+  // Triangles that fit in a block gain nothing from that and are walked as a
+  // single partial region aligned to the stamp grid instead. Blocks coincide
+  // with the framebuffer's depth blocks and get the same depth test as the
+  // whole triangle.
+  constexpr auto block_size = static_cast<int>(FrameBuffer::depth_block_size);
+  auto coarse = x_end - x_first >= block_size || y_end - y_first >= block_size;
+  auto region = coarse ? block_size : 2 * block_size;
+  auto region_x = x_first & (coarse ? ~(block_size - 1) : ~3);
+  auto region_y = y_first & (coarse ? ~(block_size - 1) : ~1);
+  const Edge *edges[] = {&edge0, &edge1, &edge2};
+  int corner_min[3];
+  int corner_max[3];
+  for (auto i = 0; i < 3; ++i) {
+    auto dx = -(block_size - 1) * edges[i]->step_x;
+    auto dy = (block_size - 1) * edges[i]->step_y;
+    corner_min[i] = std::min(dx, 0) + std::min(dy, 0);
+    corner_max[i] = std::max(dx, 0) + std::max(dy, 0);
+  }
+
+#ifdef __AVX__
+  // Blocks are covered with 4x2 pixel stamps, all eight pixels tested against
+  // the edges at once. Lanes 0-3 are the lower row.
+  __m128i lanes[3][2];
+  __m128i steps_x[3];
+  __m128i steps_y[3];
+  for (auto i = 0; i < 3; ++i) {
+    auto &edge = *edges[i];
+    lanes[i][0] = _mm_mullo_epi32(_mm_setr_epi32(0, -1, -2, -3), _mm_set1_epi32(edge.step_x));
+    lanes[i][1] = _mm_add_epi32(lanes[i][0], _mm_set1_epi32(edge.step_y));
+    steps_x[i] = _mm_set1_epi32(4 * edge.step_x);
+    steps_y[i] = _mm_set1_epi32(2 * edge.step_y);
+  }
+#endif
+
+  for (auto by = region_y; by <= y_end; by += region) {
+    for (auto bx = region_x; bx <= x_end; bx += region) {
+      int corner[3];
+      auto rejected = false;
+      auto accepted = coarse;
+      for (auto i = 0; i < 3; ++i) {
+        corner[i] = edges[i]->eq - (bx - x_first) * edges[i]->step_x +
+                    (by - y_first) * edges[i]->step_y;
+        rejected |= coarse && corner[i] + corner_max[i] < 0;
+        accepted &= corner[i] + corner_min[i] >= 0;
+      }
+      if (rejected) {
+        ++stats.blocks_rejected;
+        continue;
+      }
+      if (coarse && occluded(fb_->getMaxDepth(std::max(bx, x_first), std::max(by, y_first),
+                                              std::min(bx + region - 1, x_end),
+                                              std::min(by + region - 1, y_end)))) {
+        ++stats.blocks_occluded;
+        continue;
+      }
+      ++(accepted ? stats.blocks_accepted : stats.blocks_partial);
+
+#ifdef __AVX__
+      __m128i rows[3][2];
+      for (auto i = 0; i < 3; ++i) {
+        rows[i][0] = _mm_add_epi32(_mm_set1_epi32(corner[i]), lanes[i][0]);
+        rows[i][1] = _mm_add_epi32(_mm_set1_epi32(corner[i]), lanes[i][1]);
+      }
+
+      for (auto y = by; y < by + region && y <= y_end; y += 2) {
+        auto row_mask = 0xffu;
+        if (y < y_first)
+          row_mask &= 0xf0;
+        if (y + 1 > y_end)
+          row_mask &= 0x0f;
+
+        __m128i e[3][2];
+        std::copy_n(&rows[0][0], 6, &e[0][0]);
+
+        for (auto x = bx; x < bx + region && x <= x_end; x += 4) {
+          auto cols = 0xfu;
+          if (x < x_first)
+            cols &= 0xfu << (x_first - x);
+          if (x + 3 > x_end)
+            cols &= 0xfu >> (x + 3 - x_end);
+
+          auto covered = (cols | cols << 4) & row_mask;
+          if (!accepted) {
+            auto lo = _mm_or_si128(_mm_or_si128(e[0][0], e[1][0]), e[2][0]);
+            auto hi = _mm_or_si128(_mm_or_si128(e[0][1], e[1][1]), e[2][1]);
+            unsigned outside = _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                               _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+            covered &= ~outside;
+          }
+
+          if (covered) {
+            alignas(16) int e0[8];
+            alignas(16) int e1[8];
+            _mm_store_si128(reinterpret_cast<__m128i *>(e0), e[0][0]);
+            _mm_store_si128(reinterpret_cast<__m128i *>(e0 + 4), e[0][1]);
+            _mm_store_si128(reinterpret_cast<__m128i *>(e1), e[1][0]);
+            _mm_store_si128(reinterpret_cast<__m128i *>(e1 + 4), e[1][1]);
+            shade_stamp(x, y, covered, e0, e1);
+          }
+
+          for (auto i = 0; i < 3; ++i) {
+            e[i][0] = _mm_sub_epi32(e[i][0], steps_x[i]);
+            e[i][1] = _mm_sub_epi32(e[i][1], steps_x[i]);
+          }
+        }
+
+        for (auto i = 0; i < 3; ++i) {
+          rows[i][0] = _mm_add_epi32(rows[i][0], steps_y[i]);
+          rows[i][1] = _mm_add_epi32(rows[i][1], steps_y[i]);
+        }
+      }
+#else
+      for (auto y = by; y < by + region && y <= y_end; y += 2) {
+        for (auto x = bx; x < bx + region && x <= x_end; x += 4) {
+          int e[3][8];
+          auto covered = 0u;
+          for (auto lane = 0; lane < 8; ++lane) {
+            auto px = x + (lane & 3);
+            auto py = y + (lane >> 2);
+            for (auto i = 0; i < 3; ++i)
+              e[i][lane] = corner[i] - (px - bx) * edges[i]->step_x + (py - by) * edges[i]->step_y;
+            auto inside = px >= x_first && px <= x_end && py >= y_first && py <= y_end;
+            if (inside && (accepted || (e[0][lane] | e[1][lane] | e[2][lane]) >= 0))
+              covered |= 1u << lane;
+          }
+          if (covered)
+            shade_stamp(x, y, covered, e[0], e[1]);
+        }
+      }
+#endif
+    }
+  }
+
+  if (queue.count)
+    shadePacket(queue, tri, tile);
+}
+
+template <class Shading>
+void Pipeline::fill(const VertexH &v1, const VertexH &v2, float x, float y, float w,
+                    const Tile &tile) {
+  if (x < tile.x0 || x > tile.x1 || y < tile.y0 || y > tile.y1)
+    return;
+
+  ++tile.stats->depth_tests;
+  auto z_s = detail::lerp(v1.pos.z, v2.pos.z, w);
+  if (!earlyDepthTest(z_s, x, y, *tile.stats))
+    return;
+
+  auto z_v = detail::lerp(v1.pos.w, v2.pos.w, w);
+
+  Fragment frag;
+  float storage[max_attr_size];
+  frag.attr = &storage;
+  const float *in[] = {static_cast<const float *>(v1.attr), static_cast<const float *>(v2.attr)};
+  frag.coord.x = x;
+  frag.coord.y = y;
+  frag.coord.z = z_s;
+
+  for (auto i = 0u; i < prog_->attr_count; ++i) {
+    storage[i] = detail::lerp(*(in[0] + i) * v1.pos.w, *(in[1] + i) * v2.pos.w, w) / z_v;
+  }
+  invokeFragmentShader<Shading>(frag, tile);
+}
+
+template <unsigned AttrVecs, class Shading>
+void Pipeline::fill(const Triangle &tri, float x, float y, float w0, float w1, float w2,
+                    const Tile &tile) {
+  auto z_s = w0 * tri.v[0]->pos.z + w1 * tri.v[1]->pos.z + w2 * tri.v[2]->pos.z;
+  if (!earlyDepthTest(z_s, x, y, *tile.stats))
+    return;
+
+  Fragment frag;
+  alignas(32) float storage[max_attr_size];
+  frag.attr = &storage;
+
+  frag.coord.x = x;
+  frag.coord.y = y;
+  frag.coord.z = z_s;
+
+  // Interpolate attributes.
+  if constexpr (AttrVecs != 0) {
+    constexpr auto stride = AttrVecs * 8;
+    const float *in[] = {tri.attr, tri.attr + stride, tri.attr + 2 * stride};
+    auto z_v_rec = 1.f / (w0 * tri.v[0]->pos.w + w1 * tri.v[1]->pos.w + w2 * tri.v[2]->pos.w);
+
+#ifdef __AVX__
+    auto vw1 = _mm256_broadcast_ss(&w1);
+    auto vw2 = _mm256_broadcast_ss(&w2);
+    auto vz_rec = _mm256_broadcast_ss(&z_v_rec);
+
+    for (auto i = 0u; i < AttrVecs; ++i) {
+      auto in0 = _mm256_load_ps(in[0] + i * 8);
+      auto in1 = _mm256_load_ps(in[1] + i * 8);
+      auto in2 = _mm256_load_ps(in[2] + i * 8);
+      _mm256_store_ps(&storage[i * 8],
+                      _mm256_mul_ps(_mm256_add_ps(in0, _mm256_add_ps(_mm256_mul_ps(in1, vw1),
+                                                                     _mm256_mul_ps(in2, vw2))),
+                                    vz_rec));
+    }
+#else
+    for (auto i = 0u; i < prog_->attr_count; ++i)
+      storage[i] = (in[0][i] + in[1][i] * w1 + in[2][i] * w2) * z_v_rec;
+#endif
+  }
+
+  invokeFragmentShader<Shading>(frag, tile);
+}
+
+// Returns whether the fragment at depth z goes on to be shaded. A depth-only
+// pass writes the depth right away instead. z is compared at the precision of
+// the depth format, as it will be stored.
+inline bool Pipeline::earlyDepthTest(float z, unsigned x, unsigned y, ThreadStats &stats) {
+  z = fb_->quantizeDepth(z);
+  auto depth = fb_->getDepth(x, y);
+  if (pass_ == Pass::Shading)
+    return z == depth;
+  if (z >= depth)
+    return false;
+  if (pass_ == Pass::DepthOnly) {
+    ++stats.depth_writes;
+    fb_->setDepth(x, y, z);
+    return false;
+  }
+  return true;
+}
+
+template <class Shading>
+void Pipeline::invokeFragmentShader(const Fragment &frag, const Tile &tile) {
+  ++tile.stats->fragments;
+  Vec4 color;
+  Shading::shade(*this, frag, color);
+  fb_->setPixel(frag.coord.x, frag.coord.y, color, frag.coord.z);
+}
+
+} // namespace renderer
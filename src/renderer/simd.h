@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <concepts>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "renderer/vector.h"
+
+namespace renderer {
+
+// Eight floats processed in lockstep: one AVX register, or a plain array on
+// CPUs without AVX.
+struct Float8 {
+  Float8() = default;
+#ifdef __AVX__
+  Float8(float f) : v{_mm256_set1_ps(f)} {}
+  Float8(__m256 v) : v{v} {}
+
+  // p must be 32-byte aligned.
+  static Float8 load(const float *p) { return _mm256_load_ps(p); }
+  void store(float *p) const { _mm256_store_ps(p, v); }
+
+  __m256 v;
+#else
+  Float8(float f) { std::fill_n(v, 8, f); }
+
+  static Float8 load(const float *p) {
+    Float8 r;
+    std::copy_n(p, 8, r.v);
+    return r;
+  }
+  void store(float *p) const { std::copy_n(v, 8, p); }
+
+  float v[8];
+#endif
+
+  float operator[](unsigned i) const {
+    alignas(32) float lanes[8];
+    store(lanes);
+    return lanes[i];
+  }
+};
+
+#ifdef __AVX__
+inline Float8 operator+(const Float8 &a, const Float8 &b) { return _mm256_add_ps(a.v, b.v); }
+inline Float8 operator-(const Float8 &a, const Float8 &b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float8 operator*(const Float8 &a, const Float8 &b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float8 operator/(const Float8 &a, const Float8 &b) { return _mm256_div_ps(a.v, b.v); }
+inline Float8 operator-(const Float8 &a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f)); }
+inline Float8 min(const Float8 &a, const Float8 &b) { return _mm256_min_ps(a.v, b.v); }
+inline Float8 max(const Float8 &a, const Float8 &b) { return _mm256_max_ps(a.v, b.v); }
+inline Float8 sqrt(const Float8 &a) { return _mm256_sqrt_ps(a.v); }
+inline Float8 floor(const Float8 &a) { return _mm256_floor_ps(a.v); }
+
+// Lanes where mask is set take a, the others b; masks come from equal().
+inline Float8 select(const Float8 &mask, const Float8 &a, const Float8 &b) {
+  return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+inline Float8 equal(const Float8 &a, const Float8 &b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ);
+}
+#else
+namespace detail {
+template <class F> Float8 lanewise(F f) {
+  Float8 r;
+  for (auto i = 0u; i < 8; ++i)
+    r.v[i] = f(i);
+  return r;
+}
+} // namespace detail
+
+inline Float8 operator+(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return a.v[i] + b.v[i]; });
+}
+inline Float8 operator-(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return a.v[i] - b.v[i]; });
+}
+inline Float8 operator*(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return a.v[i] * b.v[i]; });
+}
+inline Float8 operator/(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return a.v[i] / b.v[i]; });
+}
+inline Float8 operator-(const Float8 &a) {
+  return detail::lanewise([&](auto i) { return -a.v[i]; });
+}
+inline Float8 min(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return std::min(a.v[i], b.v[i]); });
+}
+inline Float8 max(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return std::max(a.v[i], b.v[i]); });
+}
+inline Float8 sqrt(const Float8 &a) {
+  return detail::lanewise([&](auto i) { return std::sqrt(a.v[i]); });
+}
+inline Float8 floor(const Float8 &a) {
+  return detail::lanewise([&](auto i) { return std::floor(a.v[i]); });
+}
+
+// Lanes where mask is set take a, the others b; masks come from equal().
+inline Float8 select(const Float8 &mask, const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return mask.v[i] != 0.f ? a.v[i] : b.v[i]; });
+}
+inline Float8 equal(const Float8 &a, const Float8 &b) {
+  return detail::lanewise([&](auto i) { return a.v[i] == b.v[i] ? 1.f : 0.f; });
+}
+#endif
+
+// x^n for small integer n, by repeated squaring.
+inline Float8 pow(Float8 x, unsigned n) {
+  Float8 r{1.f};
+  for (; n; n >>= 1) {
+    if (n & 1)
+      r = r * x;
+    x = x * x;
+  }
+  return r;
+}
+
+struct Vec2x8 {
+  Float8 x;
+  Float8 y;
+};
+
+// The lane-wise constructors only take Float8, so that a braced list of floats
+// passed to an overloaded function such as normalize() still means a Vec3/Vec4.
+struct Vec3x8 {
+  Vec3x8() = default;
+  template <std::same_as<Float8> F>
+  Vec3x8(const F &x, const F &y, const F &z) : x{x}, y{y}, z{z} {}
+  Vec3x8(const Vec3 &v) : x{v.x}, y{v.y}, z{v.z} {}
+
+  Vec3x8 operator+(const Vec3x8 &v) const { return {x + v.x, y + v.y, z + v.z}; }
+  Vec3x8 operator-() const { return {-x, -y, -z}; }
+  Vec3x8 operator-(const Vec3x8 &v) const { return {x - v.x, y - v.y, z - v.z}; }
+  Vec3x8 operator/(const Float8 &d) const { return {x / d, y / d, z / d}; }
+  Vec3x8 operator*(const Float8 &m) const { return {x * m, y * m, z * m}; }
+  Vec3x8 operator*(const Vec3x8 &v) const { return {x * v.x, y * v.y, z * v.z}; }
+
+  Float8 x;
+  Float8 y;
+  Float8 z;
+};
+
+struct Vec4x8 {
+  Vec4x8() = default;
+  template <std::same_as<Float8> F>
+  Vec4x8(const F &x, const F &y, const F &z, const F &w) : x{x}, y{y}, z{z}, w{w} {}
+  Vec4x8(const Vec3x8 &v, const Float8 &w) : x{v.x}, y{v.y}, z{v.z}, w{w} {}
+  Vec4x8(const Vec4 &v) : x{v.x}, y{v.y}, z{v.z}, w{v.w} {}
+
+  Vec4x8 operator+(const Vec4x8 &v) const { return {x + v.x, y + v.y, z + v.z, w + v.w}; }
+  Vec4x8 operator*(const Float8 &m) const { return {x * m, y * m, z * m, w * m}; }
+  Vec4x8 operator*(const Vec4x8 &v) const { return {x * v.x, y * v.y, z * v.z, w * v.w}; }
+
+  Float8 x;
+  Float8 y;
+  Float8 z;
+  Float8 w;
+};
+
+inline Float8 dot(const Vec3x8 &u, const Vec3x8 &v) { return u.x * v.x + u.y * v.y + u.z * v.z; }
+
+inline Vec3x8 reflect(const Vec3x8 &v, const Vec3x8 &n) { return v - n * dot(n, v) * 2.f; }
+
+inline Vec3x8 normalize(const Vec3x8 &v) {
+  auto len = sqrt(dot(v, v));
+  return v * select(equal(len, 0.f), 0.f, 1.f / len);
+}
+
+} // namespace renderer
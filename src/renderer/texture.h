@@ -1,11 +1,17 @@
 #pragma once
 
 #include <algorithm>
+#include <bit>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <limits>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "renderer/simd.h"
 #include "renderer/vector.h"
 
 namespace renderer {
@@ -24,54 +30,364 @@ struct UNorm {
   };
 };
 
-template <class T> class Texture {
+// Texel layouts. A layout maps texel coordinates to an index into the texture's
+// storage, which it may pad; `span` texels starting at a multiple of span
+// along a row are contiguous.
+struct Linear {
+  constexpr static unsigned span{std::numeric_limits<unsigned>::max()};
+
+  Linear(unsigned width, unsigned height) : width_{width}, height_{height} {}
+
+  [[nodiscard]] size_t size() const { return static_cast<size_t>(width_) * height_; }
+  [[nodiscard]] size_t operator()(unsigned x, unsigned y) const {
+    return static_cast<size_t>(y) * width_ + x;
+  }
+
+private:
+  unsigned width_;
+  unsigned height_;
+};
+
+// Square blocks of N x N texels stored one after another, each row-major.
+template <unsigned N> struct Blocked {
+  static_assert(std::has_single_bit(N));
+  constexpr static unsigned span{N};
+
+  Blocked(unsigned width, unsigned height)
+      : blocks_x_{(width + N - 1) / N}, blocks_y_{(height + N - 1) / N} {}
+
+  [[nodiscard]] size_t size() const { return static_cast<size_t>(blocks_x_) * blocks_y_ * N * N; }
+  [[nodiscard]] size_t operator()(unsigned x, unsigned y) const {
+    return (static_cast<size_t>(y / N) * blocks_x_ + x / N) * N * N + y % N * N + x % N;
+  }
+
+private:
+  unsigned blocks_x_;
+  unsigned blocks_y_;
+};
+
+// Z-order curve over the texture padded to power-of-two sides. The bits of x
+// and y are interleaved up to the shorter side; the rest of the longer one
+// selects a square.
+struct Morton {
+  constexpr static unsigned span{1};
+
+  Morton(unsigned width, unsigned height)
+      : bits_{static_cast<unsigned>(std::countr_zero(std::min(std::bit_ceil(width),
+                                                               std::bit_ceil(height))))},
+        size_{static_cast<size_t>(std::bit_ceil(width)) * std::bit_ceil(height)} {}
+
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] size_t operator()(unsigned x, unsigned y) const {
+    auto mask = (1u << bits_) - 1;
+    return (spread(x & mask) | spread(y & mask) << 1) +
+           (static_cast<size_t>((x | y) >> bits_) << 2 * bits_);
+  }
+
+private:
+  // Moves bit i of v to bit 2i.
+  static size_t spread(uint32_t v) {
+    uint64_t r = v;
+    r = (r | r << 16) & 0x0000ffff0000ffff;
+    r = (r | r << 8) & 0x00ff00ff00ff00ff;
+    r = (r | r << 4) & 0x0f0f0f0f0f0f0f0f;
+    r = (r | r << 2) & 0x3333333333333333;
+    r = (r | r << 1) & 0x5555555555555555;
+    return r;
+  }
+
+  unsigned bits_;
+  size_t size_;
+};
+
+enum class Filter {
+  Nearest,   // Base level, nearest texel.
+  Bilinear,  // Nearest mip level.
+  Trilinear, // Blend of the two nearest mip levels.
+};
+
+// What coordinates outside [0, 1], and bilinear neighbours past the border,
+// read.
+enum class Wrap {
+  Clamp,  // The border texels.
+  Repeat, // The texture tiled.
+};
+
+// A texture built from a buffer of UNorm texels gets a mip chain. Writes with
+// setTexel() or through getSpan() only reach level 0, until buildMips().
+template <class T, class Layout = Linear> class Texture {
   using Type = std::conditional_t<std::is_same_v<T, UNorm>, Vec4, T>;
 
 public:
+  // buf holds the texels row by row.
   Texture(unsigned width, unsigned height, const std::vector<T> &buf)
-      : buffer_{buf}, width_{width}, height_{height} {}
+      : Texture{width, height} {
+    for (auto y = 0u; y < height_; ++y)
+      for (auto x = 0u; x < width_; x += Layout::span)
+        std::copy_n(&buf[static_cast<size_t>(y) * width_ + x], std::min(Layout::span, width_ - x),
+                    &buffer_[layout_(x, y)]);
+    if constexpr (std::is_same_v<T, UNorm>)
+      buildMips();
+  }
 
   Texture(unsigned width, unsigned height)
-      : buffer_(static_cast<size_t>(width) * height), width_{width}, height_{height} {}
+      : layout_{width, height}, buffer_(layout_.size()), width_{width}, height_{height} {}
 
+  // Without derivatives to go by, filtering reads level 0.
   [[nodiscard]] Type sample(float u, float v) const {
-    return fetchTexel(u * (width_ - 1), v * (height_ - 1));
+    if constexpr (std::is_same_v<T, UNorm>) {
+      if (filter_ != Filter::Nearest)
+        return sample(u, v, 0.f);
+    }
+    return fetchTexel(wrap(u) * (width_ - 1), wrap(v) * (height_ - 1));
   }
 
-  [[nodiscard]] Type fetchTexel(unsigned x, unsigned y) const { return buffer_[y * width_ + x]; }
+  [[nodiscard]] Vec4 sample(float u, float v, float lod) const
+    requires std::is_same_v<T, UNorm>
+  {
+    if (filter_ == Filter::Nearest)
+      return sample(u, v);
+    if (filter_ == Filter::Bilinear)
+      return sampleBilinear(u, v, static_cast<unsigned>(lod + .5f));
 
-  void setTexel(unsigned x, unsigned y, const Type &texel) { buffer_[y * width_ + x] = texel; }
+    auto level = static_cast<unsigned>(lod);
+    auto t = lod - level;
+    auto texel = sampleBilinear(u, v, level);
+    if (t == 0.f)
+      return texel;
+    return texel * (1.f - t) + sampleBilinear(u, v, level + 1) * t;
+  }
 
-  void fill(const T &val) { std::fill(buffer_.begin(), buffer_.end(), val); }
+  // Samples eight coordinate pairs. The level of detail comes from the
+  // differences across each 2x2 quad, so the lanes must be laid out as in the
+  // packets of a program with fs_quads.
+  [[nodiscard]] Vec4x8 sample(const Float8 &u, const Float8 &v) const
+    requires std::is_same_v<T, UNorm>
+  {
+    alignas(32) float us[8];
+    alignas(32) float vs[8];
+    alignas(32) float out[4][8];
+    u.store(us);
+    v.store(vs);
+    for (auto q = 0u; q < 8; q += 4) {
+      auto lod = filter_ == Filter::Nearest ? 0.f : getLod(us + q, vs + q);
+#ifdef __AVX__
+      if (filter_ != Filter::Nearest) {
+        auto u4 = _mm_load_ps(us + q);
+        auto v4 = _mm_load_ps(vs + q);
+        __m128 texels[4];
+        if (filter_ == Filter::Bilinear) {
+          sampleBilinear(u4, v4, static_cast<unsigned>(lod + .5f), texels);
+        } else {
+          auto level = static_cast<unsigned>(lod);
+          auto t = _mm_set1_ps(lod - level);
+          sampleBilinear(u4, v4, level, texels);
+          if (lod != level) {
+            __m128 next[4];
+            sampleBilinear(u4, v4, level + 1, next);
+            for (auto c = 0u; c < 4; ++c)
+              texels[c] = _mm_add_ps(texels[c], _mm_mul_ps(_mm_sub_ps(next[c], texels[c]), t));
+          }
+        }
+        for (auto c = 0u; c < 4; ++c)
+          _mm_store_ps(out[c] + q, texels[c]);
+        continue;
+      }
+#endif
+      for (auto i = q; i < q + 4; ++i) {
+        auto texel = sample(us[i], vs[i], lod);
+        for (auto c = 0u; c < 4; ++c)
+          out[c][i] = texel[c];
+      }
+    }
+    return {Float8::load(out[0]), Float8::load(out[1]), Float8::load(out[2]),
+            Float8::load(out[3])};
+  }
+
+  [[nodiscard]] Type fetchTexel(unsigned x, unsigned y) const {
+    auto &t = buffer_[layout_(x, y)];
+    if constexpr (std::is_same_v<T, UNorm>) {
+      constexpr auto div = 1.f / 255.f;
+      return {t.r * div, t.g * div, t.b * div, t.a * div};
+    } else {
+      return t;
+    }
+  }
+
+  void setTexel(unsigned x, unsigned y, const Type &texel) {
+    if constexpr (std::is_same_v<T, UNorm>)
+      buffer_[layout_(x, y)] = {static_cast<unsigned char>(std::clamp(texel.r, 0.f, 1.f) * 255.f),
+                                static_cast<unsigned char>(std::clamp(texel.g, 0.f, 1.f) * 255.f),
+                                static_cast<unsigned char>(std::clamp(texel.b, 0.f, 1.f) * 255.f),
+                                255};
+    else
+      buffer_[layout_(x, y)] = texel;
+  }
+
+  void fill(const T &val) {
+    if constexpr (std::is_same_v<T, UNorm>)
+      std::memset(buffer_.data(), val.rgba, getSize());
+    else
+      std::fill(buffer_.begin(), buffer_.end(), val);
+  }
 
   void clear() { std::memset(buffer_.data(), 0x0, getSize()); }
 
-  [[nodiscard]] size_t getSize() const { return static_cast<size_t>(width_) * height_ * sizeof(T); }
+  // Writes the texels row by row to dst, pitch bytes apart.
+  void detile(void *dst, size_t pitch) const {
+    for (auto y = 0u; y < height_; ++y) {
+      auto row = reinterpret_cast<T *>(static_cast<char *>(dst) + y * pitch);
+      for (auto x = 0u; x < width_; x += Layout::span)
+        std::copy_n(&buffer_[layout_(x, y)], std::min(Layout::span, width_ - x), row + x);
+    }
+  }
+
+  // Texels of row y from x on, contiguous up to the next multiple of the
+  // layout's span.
+  [[nodiscard]] const T *getSpan(unsigned x, unsigned y) const { return &buffer_[layout_(x, y)]; }
+  [[nodiscard]] T *getSpan(unsigned x, unsigned y) { return &buffer_[layout_(x, y)]; }
+
+  void setFilter(Filter filter) { filter_ = filter; }
+  void setWrap(Wrap wrap) { wrap_ = wrap; }
+  // Level 0 is the texture itself.
+  [[nodiscard]] const Texture &getLevel(unsigned level) const {
+    return level ? mips_[level - 1] : *this;
+  }
+  [[nodiscard]] unsigned getLevelCount() const { return mips_.size() + 1; }
+
+  // Size of the storage, including any padding of the layout.
+  [[nodiscard]] size_t getSize() const { return buffer_.size() * sizeof(T); }
   [[nodiscard]] unsigned getWidth() const { return width_; }
   [[nodiscard]] unsigned getHeight() const { return height_; }
   [[nodiscard]] const void *getRawBuffer() const { return buffer_.data(); }
 
+  // Rebuilds the mip chain from level 0, halving the size level by level down
+  // to 1x1 and averaging 2x2 texels.
+  void buildMips() {
+    mips_.clear();
+    mips_.reserve(std::bit_width(std::max(width_, height_)) - 1);
+    for (auto src = this; src->width_ > 1 || src->height_ > 1; src = &mips_.back()) {
+      Texture level{std::max(src->width_ / 2, 1u), std::max(src->height_ / 2, 1u)};
+      for (auto y = 0u; y < level.height_; ++y) {
+        for (auto x = 0u; x < level.width_; ++x) {
+          auto x1 = std::min(2 * x + 1, src->width_ - 1);
+          auto y1 = std::min(2 * y + 1, src->height_ - 1);
+          unsigned texels[] = {src->buffer_[src->layout_(2 * x, 2 * y)].rgba,
+                               src->buffer_[src->layout_(x1, 2 * y)].rgba,
+                               src->buffer_[src->layout_(2 * x, y1)].rgba,
+                               src->buffer_[src->layout_(x1, y1)].rgba};
+          auto avg = 0u;
+          for (auto shift = 0u; shift < 32; shift += 8) {
+            auto sum = 2u;
+            for (auto texel : texels)
+              sum += texel >> shift & 0xff;
+            avg |= sum / 4 << shift;
+          }
+          level.buffer_[level.layout_(x, y)] = avg;
+        }
+      }
+      mips_.push_back(std::move(level));
+    }
+  }
+
 private:
+  // Level of detail of a quad, clamped to the mip chain.
+  [[nodiscard]] float getLod(const float *u, const float *v) const {
+    auto dudx = (u[1] - u[0]) * width_;
+    auto dvdx = (v[1] - v[0]) * height_;
+    auto dudy = (u[2] - u[0]) * width_;
+    auto dvdy = (v[2] - v[0]) * height_;
+    auto lod = .5f * std::log2(std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy));
+    // Also catches NaN from helpers extrapolated far off their triangle.
+    return lod > 0.f ? std::min(lod, static_cast<float>(mips_.size())) : 0.f;
+  }
+
+  [[nodiscard]] float wrap(float u) const {
+    return wrap_ == Wrap::Repeat ? u - std::floor(u) : std::clamp(u, 0.f, 1.f);
+  }
+
+  // Texels i and i + 1 of a side of size texels, for i from -1 to size - 1.
+  [[nodiscard]] std::pair<unsigned, unsigned> neighbours(int i, unsigned size) const {
+    if (wrap_ == Wrap::Repeat) {
+      auto i0 = i < 0 ? size - 1 : static_cast<unsigned>(i);
+      return {i0, i0 + 1 == size ? 0 : i0 + 1};
+    }
+    return {static_cast<unsigned>(std::max(i, 0)),
+            std::min(static_cast<unsigned>(i + 1), size - 1)};
+  }
+
+  // Texel centers sit at half-integer coordinates.
+  [[nodiscard]] Vec4 sampleBilinear(float u, float v, unsigned level) const {
+    auto &tex = getLevel(level);
+    auto x = wrap(u) * tex.width_ - .5f;
+    auto y = wrap(v) * tex.height_ - .5f;
+    auto x_floor = std::floor(x);
+    auto y_floor = std::floor(y);
+    auto fx = x - x_floor;
+    auto fy = y - y_floor;
+
+    auto [x0, x1] = neighbours(static_cast<int>(x_floor), tex.width_);
+    auto [y0, y1] = neighbours(static_cast<int>(y_floor), tex.height_);
+    auto lower = tex.fetchTexel(x0, y0) * (1.f - fx) + tex.fetchTexel(x1, y0) * fx;
+    auto upper = tex.fetchTexel(x0, y1) * (1.f - fx) + tex.fetchTexel(x1, y1) * fx;
+    return lower * (1.f - fy) + upper * fy;
+  }
+
+#ifdef __AVX__
+  // The four lanes of a quad at once; texels[c] receives channel c.
+  void sampleBilinear(__m128 u, __m128 v, unsigned level, __m128 (&texels)[4]) const {
+    auto &tex = getLevel(level);
+    auto wrap = [&](__m128 u) {
+      if (wrap_ == Wrap::Repeat)
+        return _mm_sub_ps(u, _mm_floor_ps(u));
+      return _mm_min_ps(_mm_max_ps(u, _mm_setzero_ps()), _mm_set1_ps(1.f));
+    };
+    auto x = _mm_sub_ps(_mm_mul_ps(wrap(u), _mm_set1_ps(tex.width_)), _mm_set1_ps(.5f));
+    auto y = _mm_sub_ps(_mm_mul_ps(wrap(v), _mm_set1_ps(tex.height_)), _mm_set1_ps(.5f));
+    auto x_floor = _mm_floor_ps(x);
+    auto y_floor = _mm_floor_ps(y);
+    auto fx = _mm_sub_ps(x, x_floor);
+    auto fy = _mm_sub_ps(y, y_floor);
+
+    alignas(16) int xs[4];
+    alignas(16) int ys[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(xs), _mm_cvttps_epi32(x_floor));
+    _mm_store_si128(reinterpret_cast<__m128i *>(ys), _mm_cvttps_epi32(y_floor));
+    alignas(16) unsigned corners[4][4];
+    for (auto i = 0u; i < 4; ++i) {
+      auto [x0, x1] = neighbours(xs[i], tex.width_);
+      auto [y0, y1] = neighbours(ys[i], tex.height_);
+      corners[0][i] = tex.buffer_[tex.layout_(x0, y0)].rgba;
+      corners[1][i] = tex.buffer_[tex.layout_(x1, y0)].rgba;
+      corners[2][i] = tex.buffer_[tex.layout_(x0, y1)].rgba;
+      corners[3][i] = tex.buffer_[tex.layout_(x1, y1)].rgba;
+    }
+
+    auto lerp = [](__m128 a, __m128 b, __m128 t) {
+      return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+    };
+    auto byte_mask = _mm_set1_epi32(0xff);
+    auto scale = _mm_set1_ps(1.f / 255.f);
+    for (auto c = 0; c < 4; ++c) {
+      __m128 channel[4];
+      for (auto k = 0; k < 4; ++k) {
+        auto rgba = _mm_load_si128(reinterpret_cast<const __m128i *>(corners[k]));
+        auto bytes = _mm_srl_epi32(rgba, _mm_cvtsi32_si128(8 * c));
+        channel[k] = _mm_cvtepi32_ps(_mm_and_si128(bytes, byte_mask));
+      }
+      texels[c] = _mm_mul_ps(
+          lerp(lerp(channel[0], channel[1], fx), lerp(channel[2], channel[3], fx), fy), scale);
+    }
+  }
+#endif
+
+  Layout layout_;
   std::vector<T> buffer_;
   unsigned width_;
   unsigned height_;
+  std::vector<Texture> mips_;
+  Filter filter_{Filter::Nearest};
+  Wrap wrap_{Wrap::Clamp};
 };
 
-template <> inline Vec4 Texture<UNorm>::fetchTexel(unsigned x, unsigned y) const {
-  constexpr auto div = 1.f / 255.f;
-  auto &t = buffer_[y * width_ + x];
-  return {t.r * div, t.g * div, t.b * div, t.a * div};
-}
-
-template <> inline void Texture<UNorm>::setTexel(unsigned x, unsigned y, const Vec4 &color) {
-  buffer_[y * width_ + x] = {static_cast<unsigned char>(std::clamp(color.r, 0.f, 1.f) * 255.f),
-                             static_cast<unsigned char>(std::clamp(color.g, 0.f, 1.f) * 255.f),
-                             static_cast<unsigned char>(std::clamp(color.b, 0.f, 1.f) * 255.f),
-                             255};
-}
-
-template <> inline void Texture<UNorm>::fill(const UNorm &val) {
-  std::memset(buffer_.data(), val.rgba, getSize());
-}
-
 } // namespace renderer
@@ -0,0 +1,68 @@
+#include "renderer/thread_pool.h"
+
+namespace renderer {
+
+ThreadPool::ThreadPool(unsigned threads) {
+  for (auto i = 1u; i < threads; ++i)
+    workers_.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock{mutex_};
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto &worker : workers_)
+    worker.join();
+}
+
+void ThreadPool::run(size_t count, const Job &job) {
+  if (workers_.empty() || count <= 1) {
+    for (auto i = 0uz; i < count; ++i)
+      job(i, 0);
+    return;
+  }
+
+  {
+    std::lock_guard lock{mutex_};
+    job_ = &job;
+    count_ = count;
+    next_ = 0;
+    busy_ = workers_.size();
+    ++generation_;
+  }
+  start_cv_.notify_all();
+
+  drain(0);
+
+  std::unique_lock lock{mutex_};
+  done_cv_.wait(lock, [this] { return busy_ == 0; });
+  job_ = nullptr;
+}
+
+void ThreadPool::work(unsigned thread) {
+  auto seen = 0u;
+  while (true) {
+    {
+      std::unique_lock lock{mutex_};
+      start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_)
+        return;
+      seen = generation_;
+    }
+
+    drain(thread);
+
+    std::lock_guard lock{mutex_};
+    if (--busy_ == 0)
+      done_cv_.notify_one();
+  }
+}
+
+void ThreadPool::drain(unsigned thread) {
+  for (auto i = next_++; i < count_; i = next_++)
+    (*job_)(i, thread);
+}
+
+} // namespace renderer
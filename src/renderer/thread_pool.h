@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace renderer {
+
+// A fixed set of worker threads running parallel-for jobs. The calling thread
+// takes part in every job, so a pool of N threads spawns N - 1 workers.
+class ThreadPool {
+public:
+  using Job = std::function<void(size_t item, unsigned thread)>;
+
+  explicit ThreadPool(unsigned threads);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Calls job(item, thread) for every item in [0, count) and returns once all
+  // of them are done. Items are handed out in increasing order; thread is in
+  // [0, getThreadCount()) and identifies the thread the item runs on.
+  void run(size_t count, const Job &job);
+
+  [[nodiscard]] unsigned getThreadCount() const { return workers_.size() + 1; }
+
+private:
+  void work(unsigned thread);
+  void drain(unsigned thread);
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  const Job *job_{nullptr};
+  size_t count_{};
+  std::atomic<size_t> next_{};
+  unsigned generation_{};
+  unsigned busy_{};
+  bool stop_{false};
+};
+
+} // namespace renderer
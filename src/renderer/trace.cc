@@ -0,0 +1,51 @@
+#include <iomanip>
+#include <utility>
+
+#include "renderer/trace.h"
+
+namespace renderer {
+
+void Trace::clear() {
+  events_.clear();
+  origin_ = Clock::now();
+  draws_ = 0;
+}
+
+void Trace::addEvent(const char *name, Clock::time_point begin, Clock::time_point end,
+                     Args args) {
+  events_.push_back({name, draws_ - 1, begin, end, std::move(args)});
+}
+
+void Trace::write(std::ostream &os) const {
+  auto us = [](Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+  auto flags = os.flags();
+  auto precision = os.precision();
+  os << std::fixed << std::setprecision(3);
+
+  // Complete events on one thread of one process, a thread per draw.
+  os << "{\"traceEvents\":[";
+  auto separator = "\n";
+  for (auto draw = 0u; draw < draws_; ++draw) {
+    os << std::exchange(separator, ",\n")
+       << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << draw
+       << ",\"args\":{\"name\":\"draw " << draw << "\"}}";
+  }
+  for (auto &event : events_) {
+    os << std::exchange(separator, ",\n") << "{\"name\":\"" << event.name
+       << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.draw
+       << ",\"ts\":" << us(event.begin - origin_) << ",\"dur\":" << us(event.end - event.begin);
+    if (!event.args.empty()) {
+      os << ",\"args\":{";
+      for (auto i = 0uz; i < event.args.size(); ++i)
+        os << (i ? "," : "") << '"' << event.args[i].first << "\":" << event.args[i].second;
+      os << '}';
+    }
+    os << '}';
+  }
+  os << "\n]}\n";
+
+  os.flags(flags);
+  os.precision(precision);
+}
+
+} // namespace renderer
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace renderer {
+
+// Stage timings of the draws of a frame, written out as Chrome trace_event JSON
+// (chrome://tracing, Perfetto). Every draw gets a track of its own.
+class Trace {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Times the enclosing scope as a stage of the current draw. Does nothing
+  // without a trace.
+  class Scope {
+  public:
+    Scope(Trace *trace, const char *name)
+        : trace_{trace}, name_{name}, begin_{trace ? Clock::now() : Clock::time_point{}} {}
+    ~Scope() {
+      if (trace_)
+        trace_->addEvent(name_, begin_, Clock::now());
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    Trace *trace_;
+    const char *name_;
+    Clock::time_point begin_;
+  };
+
+  // Counters shown with an event.
+  using Args = std::vector<std::pair<const char *, size_t>>;
+
+  // Drops the events recorded so far; timestamps restart from zero.
+  void clear();
+  // Starts the track of the next draw.
+  void beginDraw() { ++draws_; }
+  void addEvent(const char *name, Clock::time_point begin, Clock::time_point end,
+                Args args = {});
+  void write(std::ostream &os) const;
+
+  [[nodiscard]] unsigned getDrawCount() const { return draws_; }
+
+private:
+  struct Event {
+    const char *name;
+    unsigned draw;
+    Clock::time_point begin, end;
+    Args args;
+  };
+
+  std::vector<Event> events_;
+  Clock::time_point origin_{Clock::now()};
+  unsigned draws_{};
+};
+
+} // namespace renderer
@@ -0,0 +1,39 @@
+// Converts an OBJ file into a binary mesh file, see app/mesh_file.h, which
+// loads without parsing. The file is only valid for builds with the same
+// ObjVertex layout and byte order.
+//
+// Usage: obj2mesh [--flat] input.obj output.mesh
+//   --flat  store three vertices per triangle instead of indexed vertices
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+#include "app/mesh_file.h"
+
+int main(int argc, char **argv) {
+  auto flat = argc > 1 && std::string{argv[1]} == "--flat";
+  if (argc != 3 + flat) {
+    std::fprintf(stderr, "usage: %s [--flat] input.obj output.mesh\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  std::string input = argv[1 + flat], output = argv[2 + flat];
+
+  try {
+    if (flat) {
+      auto vertices = app::parseObj(input);
+      app::saveMesh(output, vertices);
+      std::printf("%s: %zu vertices\n", output.c_str(), vertices.size());
+    } else {
+      auto mesh = app::parseObjIndexed(input);
+      app::saveMesh(output, mesh.vertices, mesh.indices);
+      std::printf("%s: %zu vertices, %zu indices\n", output.c_str(), mesh.vertices.size(),
+                  mesh.indices.size());
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}